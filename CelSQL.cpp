@@ -11,96 +11,213 @@
 #include <cstdio>
 #include <cstdlib>
 #include <string.h>
+#include <strings.h>
+#include <cctype>
+#include <algorithm>
+#include <cerrno>
 
     namespace sql {
         
+#pragma mark - result data
+        class ResultData {
+        public:
+            //16 bytes per value. text is copied into the arena, the value only points to it.
+            struct Value {
+                union {
+                    int64_t intVal;
+                    double doubleVal;
+                    const char *text;
+                };
+                uint32_t textLength;
+                int32_t SQLType;
+            };
+            
+            const Value *value(size_t row, int idx) const {
+                if (idx < 0 || idx >= (int)columns.size()) {
+                    return nullptr;
+                }
+                return &values[row * columns.size() + (size_t)idx];
+            }
+            
+            std::vector<std::string> columns;
+            std::map<std::string, int> columnIndexByName;
+            std::vector<Value> values;
+            TextArena text;
+        };
+        
+#pragma mark - text arena
+        TextArena::TextArena(size_t chunkSize) : m_chunkSize(chunkSize), m_next(nullptr), m_left(0), m_bytesUsed(0) {
+        }
+        
+        const char *TextArena::copy(const char *text, size_t length) {
+            size_t needed = length + 1;
+            if (needed > m_left) {
+                //oversized values get a chunk of their own so the current chunk can still be filled up
+                if (needed > m_chunkSize / 4) {
+                    m_chunks.emplace_back(new char[needed]);
+                    char *dst = m_chunks.back().get();
+                    memcpy(dst, text, length);
+                    dst[length] = 0;
+                    m_bytesUsed += needed;
+                    return dst;
+                }
+                m_chunks.emplace_back(new char[m_chunkSize]);
+                m_next = m_chunks.back().get();
+                m_left = m_chunkSize;
+            }
+            char *dst = m_next;
+            memcpy(dst, text, length);
+            dst[length] = 0;
+            m_next += needed;
+            m_left -= needed;
+            m_bytesUsed += needed;
+            return dst;
+        }
+        
 #pragma mark - row
+        //lookups by name or index run per value, their errors are literals so a miss doesn't
+        //allocate (see jsz::Error)
+        static const char *const kUnknownColumnName = "No column with that name in the result";
+        static const char *const kColumnOutOfRange = "Column index out of range";
+        
+        int Row::indexOf(const std::string &col) const {
+            auto it = m_data->columnIndexByName.find(col);
+            if (it == m_data->columnIndexByName.end()) {
+                return -1;
+            }
+            return it->second;
+        }
+        
         Result<int64_t> Row::getInteger(const int idx) const {
-            if (m_columns.find(idx) == m_columns.end()) {
-                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, "Could not retrieve value for column #" + std::to_string(idx));
+            auto v = m_data->value(m_index, idx);
+            if (!v) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
             }
-            if (m_columns.at(idx).SQLType != SQLITE_INTEGER) {
-                if (m_columns.at(idx).SQLType == SQLITE_NULL) {
+            if (v->SQLType != SQLITE_INTEGER) {
+                if (v->SQLType == SQLITE_NULL) {
                     return 0;
                 }
 
                 return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_INTEGER!");
             }
-            return m_columns.at(idx).intVal;
+            return v->intVal;
         }
         
         Result<int64_t> Row::getInteger(const std::string &col) const {
-            if (m_columnIndexByName.find(col) == m_columnIndexByName.end()) {
-                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, "Column index not found for " + col);
+            int idx = indexOf(col);
+            if (idx < 0) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
             }
-            
-            int idx = m_columnIndexByName.at(col);
             return getInteger(idx);
         }
         
         Result<std::string> Row::getText(const int idx) const {
-            if (m_columns.find(idx) == m_columns.end()) {
-                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, "Could not retrieve value for column #" + std::to_string(idx));
+            auto v = m_data->value(m_index, idx);
+            if (!v) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
             }
-            if (m_columns.at(idx).SQLType != SQLITE_TEXT) {
-                if (m_columns.at(idx).SQLType == SQLITE_NULL) {
+            if (v->SQLType != SQLITE_TEXT) {
+                if (v->SQLType == SQLITE_NULL) {
                     return std::string("<NULL>");
                 }
                 return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_TEXT!");
             }
-            return m_columns.at(idx).textVal;
+            return std::string(v->text, v->textLength);
         }
         
         Result<std::string> Row::getText(const std::string &col) const {
-            if (m_columnIndexByName.find(col) == m_columnIndexByName.end()) {
-                return jsz::Error(1, __PRETTY_FUNCTION__, "Column index not found for " + col);
+            int idx = indexOf(col);
+            if (idx < 0) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
             }
-            
-            int idx = m_columnIndexByName.at(col);
             return getText(idx);
         }
         
+        Result<TextView> Row::getTextView(const int idx) const {
+            auto v = m_data->value(m_index, idx);
+            if (!v) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
+            }
+            if (v->SQLType != SQLITE_TEXT) {
+                if (v->SQLType == SQLITE_NULL) {
+                    return TextView();
+                }
+                return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_TEXT!");
+            }
+            return TextView(v->text, v->textLength);
+        }
+        
+        Result<TextView> Row::getTextView(const std::string &col) const {
+            int idx = indexOf(col);
+            if (idx < 0) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
+            }
+            return getTextView(idx);
+        }
+        
         Result<double> Row::getDouble(const int idx) const {
-            if (m_columns.find(idx) == m_columns.end()) {
-                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, "Could not retrieve value for column #" + std::to_string(idx));
+            auto v = m_data->value(m_index, idx);
+            if (!v) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
             }
-            if (m_columns.at(idx).SQLType != SQLITE_FLOAT) {
-                if (m_columns.at(idx).SQLType == SQLITE_NULL) {
+            if (v->SQLType != SQLITE_FLOAT) {
+                if (v->SQLType == SQLITE_NULL) {
                     return 0.0;
                 }
 
                 return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_FLOAT!");
             }
-            return m_columns.at(idx).doubleVal;
+            return v->doubleVal;
         }
         
         Result<double> Row::getDouble(const std::string &col) const {
-            if (m_columnIndexByName.find(col) == m_columnIndexByName.end()) {
-                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, "Column index not found for " + col);
+            int idx = indexOf(col);
+            if (idx < 0) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
             }
-            
-            int idx = m_columnIndexByName.at(col);
             return getDouble(idx);
         }
         
         Result<int> Row::getSQLType(const int idx) const {
-            if (m_columns.find(idx) == m_columns.end()) {
-                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, "Could not retrieve value for column #" + std::to_string(idx));
+            auto v = m_data->value(m_index, idx);
+            if (!v) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
             }
-            return m_columns.at(idx).SQLType;
+            return (int)v->SQLType;
         }
         
         Result<int> Row::getSQLType(const std::string &col) const {
-            if (m_columnIndexByName.find(col) == m_columnIndexByName.end()) {
-                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, "Column index not found for " + col);
+            int idx = indexOf(col);
+            if (idx < 0) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
             }
-            
-            int idx = m_columnIndexByName.at(col);
             return getSQLType(idx);
         }
         
+        void Row::print() const {
+            for (int i = 0; i < (int)m_data->columns.size(); i++) {
+                const char *colname = m_data->columns[i].c_str();
+                auto colval = m_data->value(m_index, i);
+                if (colval->SQLType == SQLITE_INTEGER) {
+                    printf("%s => %lli\n", colname, (long long)colval->intVal);
+                }
+                if (colval->SQLType == SQLITE_FLOAT) {
+                    printf("%s => %f\n", colname, colval->doubleVal);
+                }
+                if (colval->SQLType == SQLITE_TEXT) {
+                    printf("%s => %.*s\n", colname, (int)colval->textLength, colval->text);
+                }
+                if (colval->SQLType == SQLITE_NULL) {
+                    printf("%s => <NULL>\n", colname);
+                }
+            }
+        }
+        
         
 #pragma mark - result
+        QueryResult::QueryResult() : m_data(std::make_shared<ResultData>()) {
+        }
+        
         const std::vector<Row> &QueryResult::rows() const {
             return m_rows;
         };
@@ -114,27 +231,314 @@
         }
         
         const std::vector<std::string> &QueryResult::columns() const {
-            return m_columns;
+            return m_data->columns;
         }
         
         Result<std::string> QueryResult::columnName(int index) const {
-            auto c = columns();
-            if (index < 0 || index >= c.size()) {
+            auto &c = columns();
+            if (index < 0 || index >= (int)c.size()) {
                 return jsz::Error(1, __PRETTY_FUNCTION__, "Index out of bounds!");
             }
             return c.at(index);
         }
         
         Result<int> QueryResult::columnIndex(std::string columnName) const {
-            if (m_columnIndexByName.find(columnName) == m_columnIndexByName.end()) {
-                return jsz::Error(1, __PRETTY_FUNCTION__, "Can not find column with name " + columnName);
+            auto it = m_data->columnIndexByName.find(columnName);
+            if (it == m_data->columnIndexByName.end()) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
+            }
+            return it->second;
+        }
+        
+#pragma mark - columnar result
+        Result<int> ColumnarResult::columnIndex(const std::string &columnName) const {
+            for (size_t i = 0; i < m_columns.size(); i++) {
+                if (m_columns[i].name == columnName) {
+                    return (int)i;
+                }
+            }
+            return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
+        }
+        
+        int declaredColumnType(sqlite3_stmt *stmt, int idx) {
+            const char *decl = sqlite3_column_decltype(stmt, idx);
+            if (!decl) {
+                return SQLITE_NULL;
+            }
+            std::string t(decl);
+            for (auto &c : t) {
+                c = (char)toupper((unsigned char)c);
+            }
+            if (t.find("INT") != std::string::npos) {
+                return SQLITE_INTEGER;
+            }
+            if (t.find("CHAR") != std::string::npos || t.find("CLOB") != std::string::npos || t.find("TEXT") != std::string::npos) {
+                return SQLITE_TEXT;
+            }
+            if (t.find("REAL") != std::string::npos || t.find("FLOA") != std::string::npos || t.find("DOUB") != std::string::npos) {
+                return SQLITE_FLOAT;
+            }
+            return SQLITE_NULL;
+        }
+        
+        //switches a column to type, padding the rows read so far (all NULL or integer) accordingly
+        static void setColumnType(ColumnarResult::Column &col, int type, size_t rows) {
+            if (col.SQLType == SQLITE_INTEGER && type == SQLITE_FLOAT) {
+                col.doubles.reserve(col.ints.capacity());
+                for (auto v : col.ints) {
+                    col.doubles.push_back((double)v);
+                }
+                col.ints = std::vector<int64_t>();
+            }
+            col.SQLType = type;
+            switch (type) {
+                case SQLITE_INTEGER:
+                    col.ints.resize(rows, 0);
+                    break;
+                case SQLITE_FLOAT:
+                    col.doubles.resize(rows, 0.0);
+                    break;
+                case SQLITE_TEXT:
+                    col.textOffsets.resize(rows + 1, 0);
+                    break;
+            }
+        }
+        
+#pragma mark - cursor
+        Cursor::Cursor(Statement &&stmt) : m_stmt(std::move(stmt)), m_hasRow(false), m_error(true) {
+            m_raw = m_stmt.stmt();
+            m_columnCount = m_raw ? sqlite3_column_count(m_raw) : 0;
+        }
+        
+        bool Cursor::advance() {
+            if (!m_raw || !m_error) {
+                m_hasRow = false;
+                return false;
+            }
+            
+            int s = sqlite3_step(m_raw);
+            if (s == SQLITE_ROW) {
+                m_hasRow = true;
+                return true;
+            }
+            
+            m_hasRow = false;
+            if (s != SQLITE_DONE) {
+                m_error = jsz::Error(s, __PRETTY_FUNCTION__, "Step SQLite Error: " + std::string(sqlite3_errmsg(sqlite3_db_handle(m_raw))));
+            }
+            //give the statement back early, we are done with it
+            m_stmt = Statement();
+            m_raw = nullptr;
+            return false;
+        }
+        
+        Result<bool> Cursor::next() {
+            bool row = advance();
+            if (!m_error) {
+                return m_error.error();
+            }
+            return row;
+        }
+        
+        status Cursor::error() const {
+            return m_error;
+        }
+        
+        int Cursor::columnCount() const {
+            return m_columnCount;
+        }
+        
+        bool Cursor::validColumn(int idx) const {
+            return m_hasRow && idx >= 0 && idx < m_columnCount;
+        }
+        
+        Result<std::string> Cursor::columnName(int index) const {
+            if (!m_raw || index < 0 || index >= m_columnCount) {
+                return jsz::Error(1, __PRETTY_FUNCTION__, "Index out of bounds!");
+            }
+            return std::string(sqlite3_column_name(m_raw, index));
+        }
+        
+        Result<int> Cursor::columnIndex(const std::string &columnName) const {
+            if (m_raw) {
+                for (int i = 0; i < m_columnCount; i++) {
+                    if (columnName == sqlite3_column_name(m_raw, i)) {
+                        return i;
+                    }
+                }
             }
-            return m_columnIndexByName.at(columnName);
+            return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kUnknownColumnName);
+        }
+        
+        Result<int64_t> Cursor::getInteger(const int idx) const {
+            if (!validColumn(idx)) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
+            }
+            int type = sqlite3_column_type(m_raw, idx);
+            if (type != SQLITE_INTEGER) {
+                if (type == SQLITE_NULL) {
+                    return 0;
+                }
+                return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_INTEGER!");
+            }
+            return (int64_t)sqlite3_column_int64(m_raw, idx);
+        }
+        
+        Result<int64_t> Cursor::getInteger(const std::string &col) const {
+            auto idx = columnIndex(col);
+            if (!idx) {
+                return idx.error();
+            }
+            return getInteger(idx.value());
+        }
+        
+        Result<std::string> Cursor::getText(const int idx) const {
+            if (!validColumn(idx)) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
+            }
+            int type = sqlite3_column_type(m_raw, idx);
+            if (type != SQLITE_TEXT) {
+                if (type == SQLITE_NULL) {
+                    return std::string("<NULL>");
+                }
+                return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_TEXT!");
+            }
+            const char *text = (const char *)sqlite3_column_text(m_raw, idx);
+            return std::string(text, (size_t)sqlite3_column_bytes(m_raw, idx));
+        }
+        
+        Result<std::string> Cursor::getText(const std::string &col) const {
+            auto idx = columnIndex(col);
+            if (!idx) {
+                return idx.error();
+            }
+            return getText(idx.value());
+        }
+        
+        Result<TextView> Cursor::getTextView(const int idx) const {
+            if (!validColumn(idx)) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
+            }
+            int type = sqlite3_column_type(m_raw, idx);
+            if (type != SQLITE_TEXT) {
+                if (type == SQLITE_NULL) {
+                    return TextView();
+                }
+                return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_TEXT!");
+            }
+            const char *text = (const char *)sqlite3_column_text(m_raw, idx);
+            return TextView(text, (size_t)sqlite3_column_bytes(m_raw, idx));
+        }
+        
+        Result<TextView> Cursor::getTextView(const std::string &col) const {
+            auto idx = columnIndex(col);
+            if (!idx) {
+                return idx.error();
+            }
+            return getTextView(idx.value());
+        }
+        
+        Result<double> Cursor::getDouble(const int idx) const {
+            if (!validColumn(idx)) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
+            }
+            int type = sqlite3_column_type(m_raw, idx);
+            if (type != SQLITE_FLOAT) {
+                if (type == SQLITE_NULL) {
+                    return 0.0;
+                }
+                return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Column is not SQLITE_FLOAT!");
+            }
+            return sqlite3_column_double(m_raw, idx);
+        }
+        
+        Result<double> Cursor::getDouble(const std::string &col) const {
+            auto idx = columnIndex(col);
+            if (!idx) {
+                return idx.error();
+            }
+            return getDouble(idx.value());
+        }
+        
+        Result<int> Cursor::getSQLType(const int idx) const {
+            if (!validColumn(idx)) {
+                return jsz::Error(kSQLErrorUnknownColumnName, __PRETTY_FUNCTION__, kColumnOutOfRange);
+            }
+            return sqlite3_column_type(m_raw, idx);
+        }
+        
+        Result<int> Cursor::getSQLType(const std::string &col) const {
+            auto idx = columnIndex(col);
+            if (!idx) {
+                return idx.error();
+            }
+            return getSQLType(idx.value());
+        }
+        
+#pragma mark - statement cache
+        StatementCache::StatementCache(size_t capacity) : m_capacity(capacity), m_closed(false), m_hits(0), m_misses(0) {
+        }
+        
+        StatementCache::~StatementCache() {
+            close();
+        }
+        
+        sqlite3_stmt *StatementCache::take(const std::string &sql, std::string &key) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_index.find(std::cref(sql));
+            if (it == m_index.end()) {
+                m_misses++;
+                return nullptr;
+            }
+            
+            auto entry = it->second;
+            m_index.erase(it);
+            key = std::move(entry->first);
+            sqlite3_stmt *stmt = entry->second;
+            m_lru.erase(entry);
+            m_hits++;
+            return stmt;
+        }
+        
+        void StatementCache::put(std::string &&key, sqlite3_stmt *stmt) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            
+            std::lock_guard<std::mutex> lock(m_mutex);
+            //closed, or the same SQL was checked out twice and the other one came back first
+            if (m_closed || m_capacity == 0 || m_index.find(std::cref(key)) != m_index.end()) {
+                sqlite3_finalize(stmt);
+                return;
+            }
+            
+            m_lru.push_front(std::make_pair(std::move(key), stmt));
+            m_index[std::cref(m_lru.front().first)] = m_lru.begin();
+            
+            while (m_lru.size() > m_capacity) {
+                m_index.erase(std::cref(m_lru.back().first));
+                sqlite3_finalize(m_lru.back().second);
+                m_lru.pop_back();
+            }
+        }
+        
+        void StatementCache::close() {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+            m_index.clear();
+            for (auto &e : m_lru) {
+                sqlite3_finalize(e.second);
+            }
+            m_lru.clear();
         }
         
 #pragma mark - db
-        db::db() {
-            sqlite3_config(SQLITE_CONFIG_SERIALIZED);
+        db::db() : m_database(nullptr) {
+            //MULTITHREAD: SQLite itself is thread safe, connections only lock if opened with FULLMUTEX.
+            //must happen before SQLite is initialized, i.e. before the first connection is opened
+            static std::once_flag configured;
+            std::call_once(configured, []() {
+                sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
+            });
         }
         
         db::~db() {
@@ -144,22 +548,25 @@
         }
         
         void db::close() {
+            if (m_statementCache) {
+                m_statementCache->close();
+                m_statementCache.reset();
+            }
             if (m_database) {
-                sqlite3_close(m_database);
+                //v2: if statements are still around the connection is closed once they are finalized
+                sqlite3_close_v2(m_database);
                 m_database = nullptr;
             }
         }
         
-        status db::initWithPath(const Path path, bool create) {
-            int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX;
-            if (create) {
-                flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX;
+        status db::initWithPath(const Path path, bool create, const Options &options) {
+            int flags = SQLITE_OPEN_READWRITE;
+            if (options.readOnly) {
+                flags = SQLITE_OPEN_READONLY;
+            } else if (create) {
+                flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
             }
-
-//            int err_code = sqlite3_config(SQLITE_CONFIG_SERIALIZED);
-//            if (err_code != SQLITE_OK) {
-//                return jsz::Error(err_code, __PRETTY_FUNCTION__, "sqlite3_config() error!");
-//            }
+            flags |= options.singleThread ? SQLITE_OPEN_NOMUTEX : SQLITE_OPEN_FULLMUTEX;
             
             int err_code = sqlite3_open_v2(path.to_string().c_str(),
                                            &m_database,
@@ -169,48 +576,282 @@
                 return jsz::Error(err_code, __PRETTY_FUNCTION__, "SQLite Error (" + path.to_string() + ") : " + std::string(sqlite3_errmsg(m_database)));
             }
             
+            if (options.statementCacheSize > 0) {
+                m_statementCache = std::make_shared<StatementCache>(options.statementCacheSize);
+            }
+            
+            auto res = applyOptions(options);
+            if (!res) {
+                close();
+                return res.error();
+            }
             
             return true;
         }
         
-        status db::importDump(const Path path) {
+        //pragma values can't be bound as parameters, so only plain words get through
+        static bool isPragmaWord(const std::string &s) {
+            if (s.empty()) {
+                return false;
+            }
+            for (char c : s) {
+                if (!isalnum((unsigned char)c) && c != '_') {
+                    return false;
+                }
+            }
+            return true;
+        }
+        
+        status db::applyOptions(const Options &options) {
+            if (options.busyTimeout >= 0) {
+                int err_code = sqlite3_busy_timeout(m_database, options.busyTimeout);
+                if (err_code != SQLITE_OK) {
+                    return jsz::Error(err_code, __PRETTY_FUNCTION__, "SQLite Error: " + std::string(sqlite3_errmsg(m_database)));
+                }
+            }
+            
+            std::vector<std::pair<std::string, std::string>> pragmas;
+            //before the journal mode: switching to WAL writes the header of a new database, after that
+            //auto_vacuum can only be changed by a VACUUM
+            if (!options.autoVacuum.empty() && !options.readOnly) {
+                pragmas.push_back(std::make_pair("auto_vacuum", options.autoVacuum));
+            }
+            //the journal mode is stored in the database file - read only connections can't change it
+            if (!options.journalMode.empty() && !options.readOnly) {
+                pragmas.push_back(std::make_pair("journal_mode", options.journalMode));
+            }
+            if (!options.synchronous.empty()) {
+                pragmas.push_back(std::make_pair("synchronous", options.synchronous));
+            }
+            if (!options.tempStore.empty()) {
+                pragmas.push_back(std::make_pair("temp_store", options.tempStore));
+            }
+            if (options.mmapSize >= 0) {
+                pragmas.push_back(std::make_pair("mmap_size", std::to_string(options.mmapSize)));
+            }
+            if (options.cacheSize != 0) {
+                pragmas.push_back(std::make_pair("cache_size", std::to_string(options.cacheSize)));
+            }
+            
+            for (const auto &p : pragmas) {
+                std::string value = p.second;
+                if (value[0] == '-') {
+                    value = value.substr(1);
+                }
+                if (!isPragmaWord(value)) {
+                    return jsz::Error(1, __PRETTY_FUNCTION__, "Invalid value for pragma " + p.first + ": " + p.second);
+                }
+                auto res = execute("pragma " + p.first + " = " + p.second + ";");
+                if (!res) {
+                    return res.error();
+                }
+            }
+            
+            return true;
+        }
+        
+        //whether the statement sql[0, length) starts with keyword, after whitespace and comments
+        static bool startsWithKeyword(const char *sql, size_t length, const char *keyword) {
+            const char *p = sql;
+            const char *end = sql + length;
+            for (;;) {
+                while (p < end && isspace((unsigned char)*p)) {
+                    p++;
+                }
+                if (end - p >= 2 && p[0] == '-' && p[1] == '-') {
+                    while (p < end && *p != '\n') {
+                        p++;
+                    }
+                } else if (end - p >= 2 && p[0] == '/' && p[1] == '*') {
+                    p += 2;
+                    while (end - p >= 2 && !(p[0] == '*' && p[1] == '/')) {
+                        p++;
+                    }
+                    p = std::min(p + 2, end);
+                } else {
+                    break;
+                }
+            }
+            size_t n = strlen(keyword);
+            return (size_t)(end - p) >= n && strncasecmp(p, keyword, n) == 0 &&
+                   ((size_t)(end - p) == n || !isalnum((unsigned char)p[n]));
+        }
+        
+        //the dump's own transaction statements, importDump() runs its own transactions
+        static bool isTransactionStatement(const char *sql, size_t length) {
+            return startsWithKeyword(sql, length, "BEGIN") || startsWithKeyword(sql, length, "COMMIT") || startsWithKeyword(sql, length, "END");
+        }
+        
+        //runs every statement in sql[0, length) without copying it. the dump's BEGIN/COMMIT are
+        //skipped, its ROLLBACK (sqlite3 .dump writes one when it couldn't read the whole database)
+        //stops with rolledBack set.
+        static int execRaw(sqlite3 *database, const char *sql, size_t length, bool &rolledBack) {
+            const char *end = sql + length;
+            while (sql < end) {
+                sqlite3_stmt *stmt = nullptr;
+                const char *tail = nullptr;
+                int err_code = sqlite3_prepare_v2(database, sql, (int)(end - sql), &stmt, &tail);
+                if (err_code != SQLITE_OK) {
+                    return err_code;
+                }
+                if (!stmt) {
+                    //only whitespace or comments left
+                    break;
+                }
+                size_t statementLength = (size_t)(tail - sql);
+                if (startsWithKeyword(sql, statementLength, "ROLLBACK")) {
+                    sqlite3_finalize(stmt);
+                    rolledBack = true;
+                    return SQLITE_ABORT;
+                }
+                if (!isTransactionStatement(sql, statementLength)) {
+                    while ((err_code = sqlite3_step(stmt)) == SQLITE_ROW) {
+                    }
+                }
+                sqlite3_finalize(stmt);
+                if (err_code != SQLITE_DONE && err_code != SQLITE_OK) {
+                    return err_code;
+                }
+                sql = tail;
+            }
+            return SQLITE_OK;
+        }
+        
+        status db::importDump(const Path path, size_t statementsPerTransaction, ImportProgress progress) {
             assert(m_database);
-
-            FILE *f_in = fopen(path.to_string().c_str(), "r");
+            
+            FILE *f_in = fopen(path.to_string().c_str(), "rb");
             if (!f_in) {
                 return jsz::Error(1, __PRETTY_FUNCTION__, "Couldn't open file for reading: " + path.to_string());
             }
+            std::unique_ptr<FILE, int (*)(FILE *)> file(f_in, fclose);
+            
+            if (statementsPerTransaction == 0) {
+                statementsPerTransaction = 1;
+            }
+            
+            std::vector<char> buf(1024 * 1024);
+            std::string pending;    //read but not executed yet, at most one incomplete statement after each chunk
+            uint64_t bytesRead = 0;
+            uint64_t statements = 0;
+            size_t inTransaction = 0;
+            
+            bool rolledBack = false;
             
-            char buf[255];
-            std::string s;
+            auto fail = [&](int err_code, const std::string &what) -> status {
+                std::string message = sqlite3_errmsg(m_database);
+                if (inTransaction > 0) {
+                    rollback();
+                }
+                if (rolledBack) {
+                    return jsz::Error(err_code, __PRETTY_FUNCTION__, path.to_string() + " ends in ROLLBACK, the dump is incomplete (statement " + std::to_string(statements + 1) + ")");
+                }
+                return jsz::Error(err_code, __PRETTY_FUNCTION__, what + " (statement " + std::to_string(statements + 1) + "): " + message);
+            };
+            
+            //runs sql[0, length) as one more statement of the current transaction
+            auto run = [&](const char *sql, size_t length) -> status {
+                if (inTransaction == 0) {
+                    auto stat = begin();
+                    if (!stat) {
+                        return stat;
+                    }
+                }
+                inTransaction++;
+                int err_code = execRaw(m_database, sql, length, rolledBack);
+                if (err_code != SQLITE_OK) {
+                    return fail(err_code, "Import SQLite Error");
+                }
+                statements++;
+                return true;
+            };
             
             for (;;) {
-                memset(buf, 0x00, 255);
-                size_t r = fread(buf, 1, 254, f_in);
+                size_t r = fread(buf.data(), 1, buf.size(), f_in);
                 if (r == 0) {
                     break;
                 }
-                s += std::string(buf);
+                bytesRead += r;
+                
+                size_t start = 0;
+                size_t scan = pending.size();
+                pending.append(buf.data(), r);
+                
+                //.dump ends every statement with ; and a line break. sqlite3_complete() only runs at
+                //those line ends: running it at every ; would rescan a long statement (a trigger, a
+                //string full of ;) from its start again and again.
+                for (;;) {
+                    size_t eol = pending.find('\n', scan);
+                    if (eol == std::string::npos) {
+                        break;
+                    }
+                    scan = eol + 1;
+                    size_t last = eol;
+                    while (last > start && isspace((unsigned char)pending[last - 1])) {
+                        last--;
+                    }
+                    if (last == start || pending[last - 1] != ';') {
+                        continue;
+                    }
+                    
+                    //the line break is within pending, it stands in for the terminator
+                    pending[eol] = 0;
+                    bool complete = sqlite3_complete(pending.data() + start) != 0;
+                    pending[eol] = '\n';
+                    if (!complete) {
+                        continue;
+                    }
+                    
+                    const char *sql = pending.data() + start;
+                    size_t length = scan - start;
+                    start = scan;
+                    auto stat = run(sql, length);
+                    if (!stat) {
+                        return stat;
+                    }
+                    
+                    if (inTransaction >= statementsPerTransaction) {
+                        stat = commit();
+                        if (!stat) {
+                            return fail(stat.error().code, "Commit SQLite Error");
+                        }
+                        inTransaction = 0;
+                        if (progress) {
+                            progress(bytesRead, statements);
+                        }
+                    }
+                }
+                pending.erase(0, start);
+            }
+            if (ferror(f_in)) {
+                int err = errno;
+                if (inTransaction > 0) {
+                    rollback();
+                }
+                return jsz::Error(err, __PRETTY_FUNCTION__, "Couldn't read " + path.to_string() + ": " + strerror(err));
             }
-            fclose(f_in);
-            f_in = nullptr;
             
-            if (s.length() == 0) {
+            if (bytesRead == 0) {
                 return jsz::Error(2, __PRETTY_FUNCTION__, "Read 0 bytes from " + path.to_string());
             }
-                        
-            char *errmsg = nullptr;
-            int err_code = sqlite3_exec(m_database, s.c_str(), nullptr, nullptr, &errmsg);
-            if (err_code != SQLITE_OK) {
-                std::string e = "<NULL>";
-                if (errmsg != nullptr) {
-                    e = std::string(errmsg);
+            
+            //whatever is left has no line break after its ; or no ; at all - run it if it's a statement after all
+            if (pending.find_first_not_of(" \t\r\n") != std::string::npos && sqlite3_complete((pending + ";").c_str())) {
+                auto stat = run(pending.data(), pending.size());
+                if (!stat) {
+                    return stat;
                 }
-                auto err = jsz::Error(err_code, __PRETTY_FUNCTION__, "sqlite3_exec() Error: " + e);
-                sqlite3_free(errmsg);
-                return err;
             }
             
+            if (inTransaction > 0) {
+                auto stat = commit();
+                if (!stat) {
+                    return fail(stat.error().code, "Commit SQLite Error");
+                }
+            }
+            if (progress) {
+                progress(bytesRead, statements);
+            }
             return true;
         }
         
@@ -229,6 +870,45 @@
             return Statement(stmt);
         }
         
+        Result<Statement>db::prepareCached(const std::string &query) const {
+            assert(m_database);
+            
+            if (!m_statementCache) {
+                return prepare(query);
+            }
+            
+            std::string key;
+            sqlite3_stmt *stmt = m_statementCache->take(query, key);
+            if (stmt) {
+                return Statement(stmt, m_statementCache, std::move(key));
+            }
+            
+            int err_code = sqlite3_prepare_v2(m_database,
+                                              query.c_str(),
+                                              (int)query.length(),
+                                              &stmt,
+                                              NULL);
+            if (err_code != SQLITE_OK) {
+                return jsz::Error(err_code, __PRETTY_FUNCTION__, "SQLite Error: " + std::string(sqlite3_errmsg(m_database)));
+            }
+            
+            //only cache it if the statement is the whole query text - otherwise
+            //we wouldn't find it under that text again
+            const char *sql = sqlite3_sql(stmt);
+            if (!sql || query != sql) {
+                return Statement(stmt);
+            }
+            return Statement(stmt, m_statementCache, std::string(query));
+        }
+        
+        uint64_t db::statementCacheHits() const {
+            return m_statementCache ? m_statementCache->hits() : 0;
+        }
+        
+        uint64_t db::statementCacheMisses() const {
+            return m_statementCache ? m_statementCache->misses() : 0;
+        }
+        
         status db::bindInteger(Statement &stmt, const std::string &paramName, const int64_t value) {
             assert(m_database);
 
@@ -244,7 +924,7 @@
             return true;
         }
         
-        status db::bindText(Statement &stmt, const std::string &paramName, const std::string value) {
+        status db::bindText(Statement &stmt, const std::string &paramName, const std::string &value) {
             assert(m_database);
 
             int parm_idx = sqlite3_bind_parameter_index(stmt.stmt(), paramName.c_str());
@@ -252,7 +932,7 @@
                 return jsz::Error(kSQLErrorParameterBind, __PRETTY_FUNCTION__, "Could not bind parameter: " + paramName);
             }
             
-            int err_code = sqlite3_bind_text(stmt.stmt(), parm_idx, value.c_str(), (int)strlen(value.c_str()), SQLITE_TRANSIENT);
+            int err_code = sqlite3_bind_text(stmt.stmt(), parm_idx, value.data(), (int)value.size(), SQLITE_TRANSIENT);
             if (err_code != SQLITE_OK) {
                 return jsz::Error(kSQLErrorParameterBind, __PRETTY_FUNCTION__, "bind value SQLite Error: " + std::string(sqlite3_errmsg(m_database)));
             }
@@ -293,7 +973,7 @@
         status db::execute(const std::string &query) {
             assert(m_database);
 
-            Result<Statement> stmt = prepare(query);
+            Result<Statement> stmt = prepareCached(query);
             if (!stmt) {
                 return stmt.error();
             }
@@ -309,7 +989,8 @@
                 if (err_code == SQLITE_DONE) {
                     break;
                 }
-                if (err_code != SQLITE_OK) {
+                //statements like some pragmas return rows - we don't care about them here
+                if (err_code != SQLITE_OK && err_code != SQLITE_ROW) {
                     return jsz::Error(err_code, __PRETTY_FUNCTION__, "Step SQLite Error: " + std::string(sqlite3_errmsg(m_database)));
                 }
             }
@@ -319,83 +1000,147 @@
         Result<QueryResult> db::query(const std::string &query) const {
             assert(m_database);
 
-            auto stmt = prepare(query);
+            auto stmt = prepareCached(query);
             if (!stmt) {
                 return stmt.error();
             }
+            sqlite3_stmt *raw = stmt.value().stmt();
             
             QueryResult res;
-            for (int i = 0; i < sqlite3_column_count(stmt.value().stmt()); i++) {
-                res.m_columnIndexByName[sqlite3_column_name(stmt.value().stmt(), i)] = i;
-                res.m_columns.push_back(sqlite3_column_name(stmt.value().stmt(), i));
+            ResultData &data = *res.m_data;
+            int columnCount = sqlite3_column_count(raw);
+            for (int i = 0; i < columnCount; i++) {
+                data.columnIndexByName[sqlite3_column_name(raw, i)] = i;
+                data.columns.push_back(sqlite3_column_name(raw, i));
             }
             
-            Row row;
+            size_t rowCount = 0;
             for (;;) {
-                int s = sqlite3_step(stmt.value().stmt());
+                int s = sqlite3_step(raw);
                 if (s == SQLITE_ROW) {
-                    row.m_columnIndexByName = res.m_columnIndexByName;
-                    row.m_columns.clear();
-                    
-                    for (int i = 0; i < sqlite3_column_count(stmt.value().stmt()); i++) {
-                        int type = sqlite3_column_type(stmt.value().stmt(), i);
-                        Row::AnyType val;
+                    for (int i = 0; i < columnCount; i++) {
+                        int type = sqlite3_column_type(raw, i);
+                        ResultData::Value val;
                         val.SQLType = type;
-                        val.isNull = (type == SQLITE_NULL);
+                        val.textLength = 0;
                         const unsigned char *pchar;
                         
-			//if false we will try to convert the row data into every supported type. if true only the assigned data type will be used
-			const bool typesafe_results = true;
-	                if (typesafe_results) {
-                            switch (type) {
-                                case SQLITE_INTEGER:
-                                    val.intVal = sqlite3_column_int64(stmt.value().stmt(), i);
-                                    break;
-                                case SQLITE_FLOAT:
-                                    val.doubleVal = sqlite3_column_double(stmt.value().stmt(), i);
-                                    break;
-                                case SQLITE_TEXT:
-                                    pchar = sqlite3_column_text(stmt.value().stmt(), i);
-                                    val.textVal = std::string((const char *)pchar);
-                                    break;
-                                case SQLITE_NULL:
-                                    val.isNull = true;
-                                    val.textVal = "<NULL>";
-                                    val.doubleVal = 0.0;
-                                    val.intVal = 0;
-                                    break;
-                                    
-                                default:
-                                    return jsz::Error(1, __PRETTY_FUNCTION__, "Not supported column type: " + std::to_string(type));
-                                    break;
-                            }
-                        } else {
-                            val.intVal = sqlite3_column_int64(stmt.value().stmt(), i);
-                            val.doubleVal = sqlite3_column_double(stmt.value().stmt(), i);
-                            pchar = sqlite3_column_text(stmt.value().stmt(), i);
-                            if (pchar) {
-                                val.textVal = std::string((const char *)pchar);
-                            } else {
-                                if (type == SQLITE_NULL) {
-                                    val.textVal = "<NULL>";
-                                } else {
-                                    val.textVal = "";
-                                }
-                            }
+                        switch (type) {
+                            case SQLITE_INTEGER:
+                                val.intVal = sqlite3_column_int64(raw, i);
+                                break;
+                            case SQLITE_FLOAT:
+                                val.doubleVal = sqlite3_column_double(raw, i);
+                                break;
+                            case SQLITE_TEXT:
+                                pchar = sqlite3_column_text(raw, i);
+                                val.textLength = (uint32_t)sqlite3_column_bytes(raw, i);
+                                val.text = data.text.copy((const char *)pchar, val.textLength);
+                                break;
+                            case SQLITE_NULL:
+                                val.intVal = 0;
+                                break;
+                                
+                            default:
+                                return jsz::Error(1, __PRETTY_FUNCTION__, "Not supported column type: " + std::to_string(type));
+                                break;
                         }
                         
-                        row.m_columns[i] = val;
+                        data.values.push_back(val);
                     }
-                    res.m_rows.push_back(row);
+                    rowCount++;
                 } else if (s == SQLITE_DONE) {
                     break;
                 } else {
                     return jsz::Error(s, __PRETTY_FUNCTION__, "bind value SQLite Error: " + std::string(sqlite3_errmsg(m_database)));
                 }
             }
+            
+            res.m_rows.reserve(rowCount);
+            for (size_t i = 0; i < rowCount; i++) {
+                res.m_rows.push_back(Row(res.m_data.get(), i));
+            }
+            return res;
+        }
+        
+        Result<ColumnarResult> db::queryColumns(const std::string &query) const {
+            assert(m_database);
+            
+            auto stmt = prepareCached(query);
+            if (!stmt) {
+                return stmt.error();
+            }
+            sqlite3_stmt *raw = stmt.value().stmt();
+            
+            ColumnarResult res;
+            int columnCount = sqlite3_column_count(raw);
+            res.m_columns.resize(columnCount);
+            for (int i = 0; i < columnCount; i++) {
+                auto &col = res.m_columns[i];
+                col.name = sqlite3_column_name(raw, i);
+                int declared = declaredColumnType(raw, i);
+                if (declared != SQLITE_NULL) {
+                    setColumnType(col, declared, 0);
+                }
+            }
+            
+            size_t row = 0;
+            for (;;) {
+                int s = sqlite3_step(raw);
+                if (s == SQLITE_DONE) {
+                    break;
+                }
+                if (s != SQLITE_ROW) {
+                    return jsz::Error(s, __PRETTY_FUNCTION__, "Step SQLite Error: " + std::string(sqlite3_errmsg(m_database)));
+                }
+                
+                for (int i = 0; i < columnCount; i++) {
+                    auto &col = res.m_columns[i];
+                    int type = sqlite3_column_type(raw, i);
+                    
+                    if (row % 64 == 0) {
+                        col.nullBits.push_back(0);
+                    }
+                    
+                    if (type == SQLITE_NULL) {
+                        col.nullBits[row / 64] |= (uint64_t)1 << (row % 64);
+                    } else if (col.SQLType == SQLITE_NULL || (col.SQLType == SQLITE_INTEGER && type == SQLITE_FLOAT)) {
+                        setColumnType(col, type == SQLITE_BLOB ? SQLITE_TEXT : type, row);
+                    }
+                    
+                    switch (col.SQLType) {
+                        case SQLITE_INTEGER:
+                            col.ints.push_back(type == SQLITE_NULL ? 0 : sqlite3_column_int64(raw, i));
+                            break;
+                        case SQLITE_FLOAT:
+                            col.doubles.push_back(type == SQLITE_NULL ? 0.0 : sqlite3_column_double(raw, i));
+                            break;
+                        case SQLITE_TEXT:
+                            if (type != SQLITE_NULL) {
+                                const unsigned char *pchar = sqlite3_column_text(raw, i);
+                                col.text.append((const char *)pchar, (size_t)sqlite3_column_bytes(raw, i));
+                            }
+                            col.textOffsets.push_back(col.text.size());
+                            break;
+                    }
+                }
+                row++;
+            }
+            res.m_rowCount = row;
+            
             return res;
         }
         
+        Result<Cursor> db::cursor(const std::string &query) const {
+            assert(m_database);
+            
+            auto stmt = prepareCached(query);
+            if (!stmt) {
+                return stmt.error();
+            }
+            return Cursor(std::move(stmt.value()));
+        }
+        
         Result<int64_t> db::lastInsertedRowID() const {
             assert(m_database);
 
@@ -408,5 +1153,119 @@
         status db::commit() {
             return execute("commit;");
         }
+        status db::rollback() {
+            return execute("rollback;");
+        }
+        
+#pragma mark - pool
+        Pool::Connection &Pool::Connection::operator=(Connection &&src) {
+            if (this != &src) {
+                if (m_pool) {
+                    m_pool->release(m_slot);
+                }
+                m_pool = src.m_pool;
+                m_slot = src.m_slot;
+                src.m_pool = nullptr;
+            }
+            return *this;
+        }
+        
+        Pool::Connection::~Connection() {
+            if (m_pool) {
+                m_pool->release(m_slot);
+            }
+        }
         
+        db &Pool::Connection::operator*() const {
+            assert(m_pool);
+            return m_pool->m_readers[m_slot]->connection;
+        }
+        
+        db *Pool::Connection::operator->() const {
+            return &**this;
+        }
+        
+        Pool::Pool() {
+        }
+        
+        Pool::~Pool() {
+            close();
+        }
+        
+        status Pool::open(const Path path, size_t readers, const Options &writerOptions, const Options &readerOptions) {
+            //the writer first: it creates the database and switches it to WAL before anyone reads
+            auto r = m_writer.initWithPath(path, !writerOptions.readOnly, writerOptions);
+            if (!r) {
+                return r;
+            }
+            
+            Options options = readerOptions;
+            options.readOnly = true;
+            options.singleThread = true;
+            for (size_t i = 0; i < readers; i++) {
+                std::unique_ptr<Slot> slot(new Slot());
+                slot->inUse = false;
+                r = slot->connection.initWithPath(path, false, options);
+                if (!r) {
+                    close();
+                    return r;
+                }
+                m_readers.push_back(std::move(slot));
+            }
+            return true;
+        }
+        
+        void Pool::close() {
+            for (auto &slot : m_readers) {
+                assert(!slot->inUse);
+                slot->connection.close();
+            }
+            m_readers.clear();
+            m_writer.close();
+        }
+        
+        //the reader this thread checked out last time, whatever pool that was - it's only a hint
+        static thread_local size_t t_lastSlot = 0;
+        
+        bool Pool::tryTake(size_t slot) {
+            bool expected = false;
+            return m_readers[slot]->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire);
+        }
+        
+        //the first free reader, starting at the one this thread had last. npos if all are checked out.
+        size_t Pool::takeAny() {
+            size_t count = m_readers.size();
+            size_t first = t_lastSlot % count;
+            for (size_t i = 0; i < count; i++) {
+                size_t slot = (first + i) % count;
+                if (tryTake(slot)) {
+                    t_lastSlot = slot;
+                    return slot;
+                }
+            }
+            return std::string::npos;
+        }
+        
+        Pool::Connection Pool::reader() {
+            assert(!m_readers.empty());
+            size_t slot = takeAny();
+            if (slot != std::string::npos) {
+                return Connection(this, slot);
+            }
+            
+            //all checked out: sleep until one comes back. release() notifies under the mutex, so
+            //a reader returned between the check and the wait isn't missed.
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_released.wait(lock, [&]() {
+                slot = takeAny();
+                return slot != std::string::npos;
+            });
+            return Connection(this, slot);
+        }
+        
+        void Pool::release(size_t slot) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_readers[slot]->inUse.store(false, std::memory_order_release);
+            m_released.notify_one();
+        }
     }
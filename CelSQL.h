@@ -10,6 +10,17 @@
 #include <sqlite3.h>
 #include <vector>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <tuple>
+#include <type_traits>
+#include <string>
+#include <cstring>
 #include "Types.h"
 
     namespace sql {
@@ -19,60 +30,138 @@
         
         class db;
         
+        //connection settings applied by db::initWithPath(). empty strings and negative
+        //numbers leave SQLite's defaults alone.
+        struct Options {
+            std::string journalMode;    //DELETE, TRUNCATE, PERSIST, MEMORY, WAL or OFF
+            std::string synchronous;    //OFF, NORMAL, FULL or EXTRA
+            std::string tempStore;      //DEFAULT, FILE or MEMORY
+            std::string autoVacuum;     //NONE, FULL or INCREMENTAL. only takes effect on a database without tables
+            int64_t mmapSize = -1;      //bytes
+            int64_t cacheSize = 0;      //pages, or KiB if negative (like PRAGMA cache_size). 0 keeps the default
+            int busyTimeout = -1;       //milliseconds
+            bool readOnly = false;
+            size_t statementCacheSize = 32; //prepared statements kept around by db::prepareCached(). 0 disables the cache
+            bool singleThread = false;  //the connection is only used by one thread at a time: no SQLite mutexes (NOMUTEX)
+            
+            //WAL with synchronous=NORMAL: readers don't block the writer and commits don't fsync every time.
+            //new databases give deleted pages back with PRAGMA incremental_vacuum.
+            static Options writer() {
+                Options o;
+                o.autoVacuum = "INCREMENTAL";
+                o.journalMode = "WAL";
+                o.synchronous = "NORMAL";
+                o.tempStore = "MEMORY";
+                o.mmapSize = 64 * 1024 * 1024;
+                o.busyTimeout = 5000;
+                return o;
+            }
+            
+            //for query tools next to a running writer
+            static Options reader() {
+                Options o;
+                o.readOnly = true;
+                o.tempStore = "MEMORY";
+                o.mmapSize = 64 * 1024 * 1024;
+                o.busyTimeout = 5000;
+                return o;
+            }
+        };
+        
+        //non-owning view of a text value. data is nullptr for NULL.
+        struct TextView {
+            const char *data = nullptr;
+            size_t size = 0;
+            
+            TextView() {
+            }
+            TextView(const char *data, size_t size) : data(data), size(size) {
+            }
+            
+            bool isNull() const {
+                return data == nullptr;
+            }
+            
+            std::string str() const {
+                return data ? std::string(data, size) : std::string();
+            }
+            
+            bool operator==(const std::string &other) const {
+                return size == other.size() && (size == 0 || memcmp(data, other.data(), size) == 0);
+            }
+            bool operator!=(const std::string &other) const {
+                return !(*this == other);
+            }
+        };
+        
+        //bump allocator for the text of a result: values are copied into large chunks that
+        //never move, so views into them stay valid as long as the arena lives.
+        class TextArena {
+        public:
+            explicit TextArena(size_t chunkSize = 64 * 1024);
+            
+            TextArena(const TextArena &src) = delete;
+            TextArena(TextArena &&src) = default;
+            TextArena &operator=(TextArena &&src) = default;
+            
+            //copies length bytes (plus a terminating 0) and returns the copy
+            const char *copy(const char *text, size_t length);
+            
+            size_t bytesUsed() const {
+                return m_bytesUsed;
+            }
+            
+        private:
+            std::vector<std::unique_ptr<char[]>> m_chunks;
+            size_t m_chunkSize;
+            char *m_next;
+            size_t m_left;
+            size_t m_bytesUsed;
+        };
+        
+        class ResultData;
+        
+        //a row of a QueryResult. rows are lightweight views into the result they came from
+        //and must not outlive it.
         class Row {
             friend db;
             
         public:
+            Row(const ResultData *data, size_t index) : m_data(data), m_index(index) {
+            }
+            
             Result<int64_t> getInteger(const int idx) const;
             Result<int64_t> getInteger(const std::string &col) const;
             
             Result<std::string> getText(const int idx) const;
             Result<std::string> getText(const std::string &col) const;
             
+            //no copy: the view points into the result's text arena and is valid as long as the result.
+            //NULL gives a null view
+            Result<TextView> getTextView(const int idx) const;
+            Result<TextView> getTextView(const std::string &col) const;
+            
             Result<double> getDouble(const int idx) const;
             Result<double> getDouble(const std::string &col) const;
             
             Result<int> getSQLType(const int idx) const;
             Result<int> getSQLType(const std::string &col) const;
             
-            void print() const {
-                for (auto cn : m_columnIndexByName) {
-                    auto colname = cn.first;
-                    auto colidx = cn.second;
-                    auto colval = m_columns.at(colidx);
-                    if (colval.SQLType == SQLITE_INTEGER) {
-                        printf("%s => %lli\n", colname.c_str(), colval.intVal);
-                    }
-                    if (colval.SQLType == SQLITE_FLOAT) {
-                        printf("%s => %f\n", colname.c_str(), colval.doubleVal);
-                    }
-                    if (colval.SQLType == SQLITE_TEXT) {
-                        printf("%s => %s\n", colname.c_str(), colval.textVal.c_str());
-                    }
-                    if (colval.SQLType == SQLITE_NULL) {
-                        printf("%s => <NULL>\n", colname.c_str());
-                    }
-                }
-            }
+            void print() const;
             
         private:
-            struct AnyType {
-                int64_t intVal;
-                std::string textVal;
-                double doubleVal;
-                
-                bool isNull;
-                int SQLType;
-            };
+            int indexOf(const std::string &col) const;
             
-            std::map<std::string, int> m_columnIndexByName;
-            std::map<int, AnyType> m_columns;
+            const ResultData *m_data;
+            size_t m_index;
         };
         
         class QueryResult {
             friend db;
             
         public:
+            QueryResult();
+            
             int64_t rowCount() const;
             int64_t columnCount() const;
             
@@ -83,9 +172,100 @@
             Result<int> columnIndex(std::string columnName) const;
             
         private:
-            std::map<std::string, int> m_columnIndexByName;
+            //one column schema for all rows and all values in one flat array, row after row.
+            //shared so copies of the result (and their rows) point to the same data.
+            std::shared_ptr<ResultData> m_data;
             std::vector<Row> m_rows;
-            std::vector<std::string> m_columns;
+        };
+        
+        //column oriented result: every column is one contiguous vector of its type, so loops
+        //over a column (e.g. all temperatures) are tight and vectorizable.
+        //the type of a column is its declared type, or the type of its first non NULL value.
+        //integer columns that meet a float are promoted to float, other mismatches are converted
+        //by SQLite. NULL cells hold 0 (or "") and are marked in the null bitmap.
+        class ColumnarResult {
+            friend db;
+            
+        public:
+            struct Column {
+                std::string name;
+                int SQLType = SQLITE_NULL; //SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_NULL if all values are NULL
+                
+                std::vector<int64_t> ints;          //SQLITE_INTEGER
+                std::vector<double> doubles;        //SQLITE_FLOAT
+                std::string text;                   //SQLITE_TEXT: all values back to back,
+                std::vector<uint64_t> textOffsets;  //value i is text[textOffsets[i], textOffsets[i + 1])
+                
+                std::vector<uint64_t> nullBits;     //bit i is set if row i is NULL
+                
+                bool isNull(size_t row) const {
+                    return (nullBits[row / 64] >> (row % 64)) & 1;
+                }
+                
+                std::string textAt(size_t row) const {
+                    return textViewAt(row).str();
+                }
+                
+                //valid as long as the result
+                TextView textViewAt(size_t row) const {
+                    if (isNull(row)) {
+                        return TextView();
+                    }
+                    return TextView(text.data() + textOffsets[row], textOffsets[row + 1] - textOffsets[row]);
+                }
+            };
+            
+            size_t rowCount() const {
+                return m_rowCount;
+            }
+            
+            const std::vector<Column> &columns() const {
+                return m_columns;
+            }
+            
+            Result<int> columnIndex(const std::string &columnName) const;
+            
+        private:
+            std::vector<Column> m_columns;
+            size_t m_rowCount = 0;
+        };
+        
+        //LRU cache of prepared statements keyed by their SQL text. only idle statements
+        //live in here: db::prepareCached() takes one out and the Statement puts it back
+        //(reset, bindings cleared) when it goes out of scope.
+        class StatementCache {
+        public:
+            StatementCache(size_t capacity);
+            ~StatementCache();
+            
+            StatementCache(const StatementCache &src) = delete;
+            StatementCache &operator=(const StatementCache &src) = delete;
+            
+            //nullptr on a miss. on a hit the key string is moved into key so it can be handed back without copying.
+            sqlite3_stmt *take(const std::string &sql, std::string &key);
+            void put(std::string &&key, sqlite3_stmt *stmt);
+            
+            //finalizes all idle statements. statements put back afterwards are finalized right away.
+            void close();
+            
+            uint64_t hits() const {
+                return m_hits;
+            }
+            uint64_t misses() const {
+                return m_misses;
+            }
+            
+        private:
+            typedef std::list<std::pair<std::string, sqlite3_stmt *>> LRUList;
+            typedef std::unordered_map<std::reference_wrapper<const std::string>, LRUList::iterator, std::hash<std::string>, std::equal_to<std::string>> Index;
+            
+            std::mutex m_mutex;
+            size_t m_capacity;
+            bool m_closed;
+            LRUList m_lru;  //most recently used first
+            Index m_index;
+            std::atomic<uint64_t> m_hits;
+            std::atomic<uint64_t> m_misses;
         };
         
         //a RAII wrapper for sqlite3_stmt
@@ -97,69 +277,506 @@
             Statement(sqlite3_stmt *stmt) {
                 m_stmt = stmt;
             }
+            //a statement that goes back into cache instead of being finalized
+            Statement(sqlite3_stmt *stmt, const std::shared_ptr<StatementCache> &cache, std::string &&key) : m_stmt(stmt), m_cache(cache), m_cacheKey(std::move(key)) {
+            }
             ~Statement() {
-                if (m_stmt) {
-//                    printf("finalize\n");
-                    sqlite3_finalize(m_stmt);
-                    m_stmt = nullptr;
-                }
+                release();
             }
             
             //no copy constructor, only move
             Statement(const Statement &src) = delete;
-            Statement(Statement &&src) {
+            Statement(Statement &&src) : m_cache(std::move(src.m_cache)), m_cacheKey(std::move(src.m_cacheKey)) {
                 m_stmt = src.m_stmt;
                 src.m_stmt = nullptr;   //prevent src from finalizing m_stmt in its destructor
             }
+            Statement &operator=(Statement &&src) {
+                if (this != &src) {
+                    release();
+                    m_stmt = src.m_stmt;
+                    m_cache = std::move(src.m_cache);
+                    m_cacheKey = std::move(src.m_cacheKey);
+                    src.m_stmt = nullptr;
+                }
+                return *this;
+            }
 
             void reset() {
                 sqlite3_reset(m_stmt);
             }
             
+            //binds args to the parameters 1..n in order - named parameters count in the order
+            //they appear in the SQL text. the types are resolved at compile time.
+            //text: lvalue strings are bound without a copy and must stay alive until the statement
+            //was executed; temporaries and const char * are copied by SQLite.
+            //nullptr binds NULL.
+            template <class... Args>
+            status bind(Args&&... args) {
+                int expected = sqlite3_bind_parameter_count(m_stmt);
+                if (expected != (int)sizeof...(Args)) {
+                    return jsz::Error(kSQLErrorParameterBind, __PRETTY_FUNCTION__, "Statement expects " + std::to_string(expected) + " parameters, got " + std::to_string(sizeof...(Args)));
+                }
+                
+                sqlite3_reset(m_stmt);
+                int err_code = bindFrom(1, std::forward<Args>(args)...);
+                if (err_code != SQLITE_OK) {
+                    return jsz::Error(kSQLErrorParameterBind, __PRETTY_FUNCTION__, "bind value SQLite Error: " + std::string(sqlite3_errmsg(sqlite3_db_handle(m_stmt))));
+                }
+                return true;
+            }
+            
             sqlite3_stmt *stmt() {
                 return m_stmt;
             }
 
-            //TODO: fuck with assignment operator
             void transferOwnershipTo(Statement &other) {
-                other.m_stmt = m_stmt;
-                m_stmt = nullptr;
+                other = std::move(*this);
             }
             
         private:
+            int bindFrom(int) {
+                return SQLITE_OK;
+            }
+            
+            template <class T, class... Rest>
+            int bindFrom(int idx, T&& value, Rest&&... rest) {
+                int err_code = bindValue(idx, std::forward<T>(value));
+                if (err_code != SQLITE_OK) {
+                    return err_code;
+                }
+                return bindFrom(idx + 1, std::forward<Rest>(rest)...);
+            }
+            
+            template <class T, typename std::enable_if<std::is_integral<typename std::decay<T>::type>::value, int>::type = 0>
+            int bindValue(int idx, T value) {
+                return sqlite3_bind_int64(m_stmt, idx, (sqlite3_int64)value);
+            }
+            
+            template <class T, typename std::enable_if<std::is_floating_point<typename std::decay<T>::type>::value, int>::type = 0>
+            int bindValue(int idx, T value) {
+                return sqlite3_bind_double(m_stmt, idx, (double)value);
+            }
+            
+            int bindValue(int idx, std::string &value) {
+                return sqlite3_bind_text(m_stmt, idx, value.data(), (int)value.size(), SQLITE_STATIC);
+            }
+            
+            int bindValue(int idx, const std::string &value) {
+                return sqlite3_bind_text(m_stmt, idx, value.data(), (int)value.size(), SQLITE_STATIC);
+            }
+            
+            int bindValue(int idx, std::string &&value) {
+                return sqlite3_bind_text(m_stmt, idx, value.data(), (int)value.size(), SQLITE_TRANSIENT);
+            }
+            
+            int bindValue(int idx, const char *value) {
+                return sqlite3_bind_text(m_stmt, idx, value, -1, SQLITE_TRANSIENT);
+            }
+            
+            int bindValue(int idx, std::nullptr_t) {
+                return sqlite3_bind_null(m_stmt, idx);
+            }
+            
+            void release() {
+                if (m_stmt) {
+                    if (m_cache) {
+                        m_cache->put(std::move(m_cacheKey), m_stmt);
+                        m_cache.reset();
+                    } else {
+//                        printf("finalize\n");
+                        sqlite3_finalize(m_stmt);
+                    }
+                    m_stmt = nullptr;
+                }
+            }
+            
             sqlite3_stmt *m_stmt;
+            std::shared_ptr<StatementCache> m_cache;
+            std::string m_cacheKey;
+        };
+        
+        
+        //forward only cursor over the rows of a statement. decodes one row at a time, so memory
+        //use doesn't depend on the number of rows. the getters read the current row and follow
+        //the same rules as the ones of Row. destroying the cursor early is fine.
+        //
+        //  auto cur = db.cursor("select timestamp, temp from data;");
+        //  for (auto &row : cur.value()) { ... row.getDouble(1) ... }
+        //  if (!cur.value().error()) { ... }
+        class Cursor {
+        public:
+            Cursor(Statement &&stmt);
+            
+            Cursor(const Cursor &src) = delete;
+            Cursor(Cursor &&src) = default;
+            Cursor &operator=(Cursor &&src) = default;
+            
+            //true if there is a new current row, false at the end. errors end the iteration too.
+            Result<bool> next();
+            
+            //the error that ended the iteration (true if there was none)
+            status error() const;
+            
+            int columnCount() const;
+            Result<std::string> columnName(int index) const;
+            Result<int> columnIndex(const std::string &columnName) const;
+            
+            Result<int64_t> getInteger(const int idx) const;
+            Result<int64_t> getInteger(const std::string &col) const;
+            
+            Result<std::string> getText(const int idx) const;
+            Result<std::string> getText(const std::string &col) const;
+            
+            //no copy: the view points to SQLite's buffer and is only valid until the next step.
+            //NULL gives a null view
+            Result<TextView> getTextView(const int idx) const;
+            Result<TextView> getTextView(const std::string &col) const;
+            
+            Result<double> getDouble(const int idx) const;
+            Result<double> getDouble(const std::string &col) const;
+            
+            Result<int> getSQLType(const int idx) const;
+            Result<int> getSQLType(const std::string &col) const;
+            
+            class iterator {
+            public:
+                iterator(Cursor *cursor) : m_cursor(cursor) {
+                }
+                Cursor &operator*() const {
+                    return *m_cursor;
+                }
+                iterator &operator++() {
+                    if (!m_cursor->advance()) {
+                        m_cursor = nullptr;
+                    }
+                    return *this;
+                }
+                bool operator!=(const iterator &other) const {
+                    return m_cursor != other.m_cursor;
+                }
+            private:
+                Cursor *m_cursor;
+            };
+            
+            iterator begin() {
+                return advance() ? iterator(this) : end();
+            }
+            iterator end() {
+                return iterator(nullptr);
+            }
+            
+        private:
+            bool advance();
+            bool validColumn(int idx) const;
+            
+            Statement m_stmt;
+            sqlite3_stmt *m_raw;
+            int m_columnCount;
+            bool m_hasRow;
+            status m_error;
+        };
+        
+        //the type a column gets from its declaration (affinity rules), SQLITE_NULL if it has none
+        //(e.g. expressions)
+        int declaredColumnType(sqlite3_stmt *stmt, int idx);
+        
+        //C++11 has no std::index_sequence
+        template <size_t... I>
+        struct IndexSequence {
+        };
+        
+        template <size_t N, size_t... I>
+        struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {
+        };
+        
+        template <size_t... I>
+        struct MakeIndexSequence<0, I...> : IndexSequence<I...> {
+        };
+        
+        //how a column is read into T. accepts() is checked once per query against the declared
+        //type of the column, read() is called for every cell. NULL reads as 0 or empty text.
+        template <class T, class Enable = void>
+        struct ColumnReader;
+        
+        template <class T>
+        struct ColumnReader<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+            static bool accepts(int declaredType) {
+                return declaredType == SQLITE_INTEGER || declaredType == SQLITE_NULL;
+            }
+            static T read(sqlite3_stmt *stmt, int idx) {
+                return (T)sqlite3_column_int64(stmt, idx);
+            }
+        };
+        
+        template <class T>
+        struct ColumnReader<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+            static bool accepts(int declaredType) {
+                return declaredType != SQLITE_TEXT;
+            }
+            static T read(sqlite3_stmt *stmt, int idx) {
+                return (T)sqlite3_column_double(stmt, idx);
+            }
+        };
+        
+        template <>
+        struct ColumnReader<std::string> {
+            static bool accepts(int) {
+                return true;
+            }
+            static std::string read(sqlite3_stmt *stmt, int idx) {
+                const char *text = (const char *)sqlite3_column_text(stmt, idx);
+                return text ? std::string(text, (size_t)sqlite3_column_bytes(stmt, idx)) : std::string();
+            }
+        };
+        
+        //a fixed row shape: column count and types are checked once, then every row is decoded
+        //straight into a tuple
+        template <class... Ts>
+        struct TypedRow {
+            typedef std::tuple<Ts...> Tuple;
+            
+            static status check(sqlite3_stmt *stmt) {
+                int count = sqlite3_column_count(stmt);
+                if (count != (int)sizeof...(Ts)) {
+                    return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Query returns " + std::to_string(count) + " columns, expected " + std::to_string(sizeof...(Ts)));
+                }
+                return check(stmt, MakeIndexSequence<sizeof...(Ts)>());
+            }
+            
+            static Tuple read(sqlite3_stmt *stmt) {
+                return read(stmt, MakeIndexSequence<sizeof...(Ts)>());
+            }
+            
+        private:
+            template <size_t... I>
+            static status check(sqlite3_stmt *stmt, IndexSequence<I...>) {
+                bool accepted[] = {true, ColumnReader<Ts>::accepts(declaredColumnType(stmt, (int)I))...};
+                for (size_t i = 0; i < sizeof...(Ts); i++) {
+                    if (!accepted[i + 1]) {
+                        return jsz::Error(kSQLTypeError, __PRETTY_FUNCTION__, "Declared type of column " + std::string(sqlite3_column_name(stmt, (int)i)) + " does not match");
+                    }
+                }
+                return true;
+            }
+            
+            template <size_t... I>
+            static Tuple read(sqlite3_stmt *stmt, IndexSequence<I...>) {
+                return Tuple(ColumnReader<Ts>::read(stmt, (int)I)...);
+            }
         };
         
+        //maps the columns of a query onto a struct for db::queryAs<T>(). specialize it like
+        //
+        //  template <> struct RowMapping<Point> {
+        //      typedef std::tuple<int64_t, double> Columns;
+        //      static Point make(int64_t timestamp, double temp) { ... }
+        //  };
+        template <class T>
+        struct RowMapping;
+        
+        template <class T, class Tuple>
+        struct MappedRow;
+        
+        template <class T, class... Ts>
+        struct MappedRow<T, std::tuple<Ts...>> {
+            typedef T Tuple;
+            
+            static status check(sqlite3_stmt *stmt) {
+                return TypedRow<Ts...>::check(stmt);
+            }
+            
+            static T read(sqlite3_stmt *stmt) {
+                return read(stmt, MakeIndexSequence<sizeof...(Ts)>());
+            }
+            
+        private:
+            template <size_t... I>
+            static T read(sqlite3_stmt *stmt, IndexSequence<I...>) {
+                return RowMapping<T>::make(ColumnReader<Ts>::read(stmt, (int)I)...);
+            }
+        };
         
         class db {
         public:
             db();
             ~db();
             
-            status initWithPath(const Path path, bool create);
+            status initWithPath(const Path path, bool create, const Options &options = Options());
             void close();
             
             status begin();
             status commit();
+            status rollback();
             
-            status importDump(const Path path);
+            //bytes of the dump read so far and statements executed so far
+            typedef std::function<void(uint64_t bytesRead, uint64_t statements)> ImportProgress;
+            
+            //runs the SQL statements of a dump (e.g. from sqlite3 .dump) one by one while reading it,
+            //committing every statementsPerTransaction statements. BEGIN/COMMIT of the dump itself are
+            //skipped, a ROLLBACK (an incomplete dump) fails the import. memory use doesn't depend on
+            //the size of the dump.
+            status importDump(const Path path, size_t statementsPerTransaction = 10000, ImportProgress progress = nullptr);
             
             Result<Statement>prepare(const std::string &query) const;
+            //like prepare() but reuses an earlier prepared statement for the same SQL text if there is one.
+            //the statement must not outlive the db.
+            Result<Statement>prepareCached(const std::string &query) const;
+            
+            uint64_t statementCacheHits() const;
+            uint64_t statementCacheMisses() const;
             status bindInteger(Statement &stmt, const std::string &paramName, const int64_t value);
-            status bindText(Statement &stmt, const std::string &paramName, const std::string value);
+            status bindText(Statement &stmt, const std::string &paramName, const std::string &value);
             status bindDouble(Statement &stmt, const std::string &paramName, const double value);
             status bindNull(Statement &stmt, const std::string &paramName);
 
             status execute(Statement &stmt);
             status execute(const std::string &query);
             
+            //binds args positionally (see Statement::bind()) and executes the statement
+            template <class... Args>
+            status execute(Statement &stmt, Args&&... args) {
+                auto r = stmt.bind(std::forward<Args>(args)...);
+                if (!r) {
+                    return r;
+                }
+                return execute(stmt);
+            }
+            
             Result<int64_t> lastInsertedRowID() const;
             
+            //the raw connection for things CelSQL doesn't wrap
+            sqlite3 *handle() const {
+                return m_database;
+            }
+            
             //all rows will be loaded into memory - so be wise what you query for!
             Result<QueryResult> query(const std::string &query) const;
             
+            //all rows as well, but stored column by column, see ColumnarResult
+            Result<ColumnarResult> queryColumns(const std::string &query) const;
+            
+            //streams the rows one by one instead, see Cursor
+            Result<Cursor> cursor(const std::string &query) const;
+            
+            //for fixed shape queries: the caller states the column types, e.g.
+            //  db.query<int64_t, double>("select timestamp, temp from data where timestamp > ?", from)
+            //column count and declared types are checked once, the rows are decoded without lookups.
+            //args are bound positionally like Statement::bind().
+            template <class... Ts, class... Args>
+            Result<std::vector<std::tuple<Ts...>>> query(const std::string &query, Args&&... args) const {
+                return queryRows<TypedRow<Ts...>>(query, std::forward<Args>(args)...);
+            }
+            
+            //like query<Ts...>() but every row is turned into a T through RowMapping<T>
+            template <class T, class... Args>
+            Result<std::vector<T>> queryAs(const std::string &query, Args&&... args) const {
+                return queryRows<MappedRow<T, typename RowMapping<T>::Columns>>(query, std::forward<Args>(args)...);
+            }
+            
         private:
+            template <class Shape, class... Args>
+            Result<std::vector<typename Shape::Tuple>> queryRows(const std::string &query, Args&&... args) const {
+                auto stmt = prepareCached(query);
+                if (!stmt) {
+                    return stmt.error();
+                }
+                auto r = stmt.value().bind(std::forward<Args>(args)...);
+                if (!r) {
+                    return r.error();
+                }
+                sqlite3_stmt *raw = stmt.value().stmt();
+                r = Shape::check(raw);
+                if (!r) {
+                    return r.error();
+                }
+                
+                std::vector<typename Shape::Tuple> rows;
+                int s;
+                while ((s = sqlite3_step(raw)) == SQLITE_ROW) {
+                    rows.push_back(Shape::read(raw));
+                }
+                if (s != SQLITE_DONE) {
+                    return jsz::Error(s, __PRETTY_FUNCTION__, "Step SQLite Error: " + std::string(sqlite3_errmsg(m_database)));
+                }
+                return rows;
+            }
+            
+            status applyOptions(const Options &options);
+            
             sqlite3 *m_database;
+            std::shared_ptr<StatementCache> m_statementCache;
+        };
+        
+        //one writer connection plus a fixed number of read-only connections. a reader is checked
+        //out by one thread at a time, so the readers run without SQLite mutexes (NOMUTEX) and
+        //queries on different threads don't serialize on one connection.
+        //a thread gets the reader it used last time back if it is free - without taking a lock.
+        class Pool {
+        public:
+            //a checked out reader, it goes back to the pool on destruction
+            class Connection {
+                friend Pool;
+                
+            public:
+                Connection() : m_pool(nullptr), m_slot(0) {
+                }
+                Connection(Connection &&src) : m_pool(src.m_pool), m_slot(src.m_slot) {
+                    src.m_pool = nullptr;
+                }
+                Connection &operator=(Connection &&src);
+                Connection(const Connection &src) = delete;
+                ~Connection();
+                
+                db &operator*() const;
+                db *operator->() const;
+                
+            private:
+                Connection(Pool *pool, size_t slot) : m_pool(pool), m_slot(slot) {
+                }
+                
+                Pool *m_pool;
+                size_t m_slot;
+            };
+            
+            Pool();
+            ~Pool();
+            
+            Pool(const Pool &src) = delete;
+            Pool &operator=(const Pool &src) = delete;
+            
+            //the writer creates the database if needed - unless writerOptions are read-only too, for
+            //tools that only query. readerOptions are forced to read-only and single thread.
+            status open(const Path path, size_t readers, const Options &writerOptions = Options::writer(), const Options &readerOptions = Options::reader());
+            //all connections must be back in the pool
+            void close();
+            
+            //the writer is shared and serialized (FULLMUTEX)
+            db &writer() {
+                return m_writer;
+            }
+            
+            //blocks while all readers are checked out
+            Connection reader();
+            
+            size_t readerCount() const {
+                return m_readers.size();
+            }
+            
+        private:
+            struct Slot {
+                db connection;
+                std::atomic<bool> inUse;
+            };
+            
+            bool tryTake(size_t slot);
+            size_t takeAny();
+            void release(size_t slot);
+            
+            db m_writer;
+            std::vector<std::unique_ptr<Slot>> m_readers;
+            
+            std::mutex m_mutex;
+            std::condition_variable m_released;
         };
         
     }
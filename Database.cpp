@@ -1,37 +1,568 @@
 #include "Database.h"
-#include "CelSQL.h"
-#include <ctime>
+#include "Migrations.h"
+#include <algorithm>
+
+namespace sql {
+    template <>
+    struct RowMapping<::db::Match> {
+        typedef std::tuple<std::string, int64_t, double, double, double> Columns;
+        static ::db::Match make(std::string serial, int64_t timestamp, double temp, double tempMin, double tempMax) {
+            return ::db::Match{std::move(serial), (std::time_t)timestamp, temp, tempMin, tempMax};
+        }
+    };
+}
 
 namespace db {
-    status addEntry(double temperature) {
-        sql::db db;
-        auto res = db.initWithPath("temp.db", false);
+    status Store::open(const Path path, const sql::Options &options) {
+        auto res = m_db.initWithPath(path, true, options);
         if (!res) {
             return res.error();
         }
-        
+
+        res = migrate(m_db);
+        if (res) {
+            res = restoreIndexes();
+        }
+        if (!res) {
+            m_db.close();
+            return res.error();
+        }
+
+        std::string qry = "insert into data (timestamp, temp, sensor_id, temp_min, temp_max, samples) VALUES (:timestamp, :temp, :sensor_id, :temp_min, :temp_max, :samples);";
+        auto stmt = m_db.prepare(qry);
+        if (!stmt) {
+            return stmt.error();
+        }
+        m_insert = std::move(stmt.value());
+
+        return true;
+    }
+
+    void Store::close() {
+        m_insert = sql::Statement();
+        m_sensorIDs.clear();
+        m_db.close();
+    }
+
+    Result<int64_t> Store::sensorID(const std::string &serial) {
+        auto it = m_sensorIDs.find(serial);
+        if (it != m_sensorIDs.end()) {
+            return it->second;
+        }
+
+        auto stmt = m_db.prepareCached("insert or ignore into sensors (serial) values (:serial);");
+        if (!stmt) {
+            return stmt.error();
+        }
+        auto r = m_db.execute(stmt.value(), serial);
+        if (!r) {
+            return r.error();
+        }
+
+        auto rows = m_db.query<int64_t>("select id from sensors where serial = :serial;", serial);
+        if (!rows) {
+            return rows.error();
+        }
+        if (rows.value().empty()) {
+            return jsz::Error(1, __PRETTY_FUNCTION__, "Could not look up sensor " + serial);
+        }
+        int64_t id = std::get<0>(rows.value()[0]);
+
+        m_sensorIDs[serial] = id;
+        return id;
+    }
+
+    status Store::insert(int64_t sensorID, const Point &point) {
+        //parameters in the order of the insert statement in open()
+        return m_db.execute(m_insert, point.timestamp, point.temp, sensorID, point.tempMin, point.tempMax, point.samples);
+    }
+
+    static Point rawPoint(double temperature, std::time_t timestamp) {
+        Point p;
+        p.timestamp = timestamp;
+        p.temp = temperature;
+        p.tempMin = temperature;
+        p.tempMax = temperature;
+        p.samples = 1;
+        return p;
+    }
+
+    status Store::addPoint(const std::string &sensorSerial, const Point &point) {
+        Batch batch;
+        batch.push_back(std::make_pair(sensorSerial, point));
+        return addPoints(batch);
+    }
+
+    status Store::addEntry(const std::string &sensorSerial, double temperature, std::time_t timestamp) {
+        return addPoint(sensorSerial, rawPoint(temperature, timestamp));
+    }
+
+    //entries without a known probe go to sensor 0, same as the readings from before sensor ids existed
+    status Store::addEntry(double temperature) {
         std::time_t now;
         std::time(&now);
+        IDBatch batch;
+        batch.push_back(std::make_pair((int64_t)0, rawPoint(temperature, now)));
+        return addBulk(batch);
+    }
 
-        std::string qry = "insert into data (timestamp, temp) VALUES (:timestamp, :temp);";
-        auto stmt = db.prepare(qry);
+    status Store::addPoints(const Batch &points) {
+        IDBatch resolved;
+        resolved.reserve(points.size());
+        for (const auto &p : points) {
+            auto sid = sensorID(p.first);
+            if (!sid) {
+                return sid.error();
+            }
+            resolved.push_back(std::make_pair(sid.value(), p.second));
+        }
+        return addBulk(resolved);
+    }
+
+    //rows per multi row insert. 6 parameters each stays below SQLite's old limit of 999 parameters
+    static const size_t kBulkRows = 128;
+    static const size_t kBulkColumns = 6;
+
+    static std::string bulkInsertSQL(size_t rows) {
+        std::string qry = "insert into data (timestamp, temp, sensor_id, temp_min, temp_max, samples) VALUES ";
+        for (size_t i = 0; i < rows; i++) {
+            qry += i == 0 ? "(?,?,?,?,?,?)" : ",(?,?,?,?,?,?)";
+        }
+        return qry + ";";
+    }
+
+    static void accumulate(Store::Rollups &rollups, int64_t sensorID, int64_t bucket, const Point &point) {
+        auto it = rollups.find(std::make_pair(sensorID, bucket));
+        if (it == rollups.end()) {
+            Rollup r;
+            r.tempMin = point.tempMin;
+            r.tempMax = point.tempMax;
+            r.tempSum = point.temp * (double)point.samples;
+            r.samples = point.samples;
+            rollups[std::make_pair(sensorID, bucket)] = r;
+            return;
+        }
+        Rollup &r = it->second;
+        r.tempMin = std::min(r.tempMin, point.tempMin);
+        r.tempMax = std::max(r.tempMax, point.tempMax);
+        r.tempSum += point.temp * (double)point.samples;
+        r.samples += point.samples;
+    }
+
+    //merges the rollups of a batch into table, inside the batch's transaction.
+    //insert or ignore + update instead of an upsert: the Pi's SQLite predates ON CONFLICT DO UPDATE
+    status Store::writeRollups(const std::string &table, const Rollups &rollups) {
+        auto create = m_db.prepareCached("insert or ignore into " + table + " (sensor_id, bucket, temp_min, temp_max, temp_sum, samples) values (?, ?, ?, ?, 0, 0);");
+        if (!create) {
+            return create.error();
+        }
+        auto update = m_db.prepareCached("update " + table + " set temp_min = min(temp_min, ?), temp_max = max(temp_max, ?), temp_sum = temp_sum + ?, samples = samples + ? where sensor_id = ? and bucket = ?;");
+        if (!update) {
+            return update.error();
+        }
+
+        for (const auto &e : rollups) {
+            const Rollup &r = e.second;
+            auto res = m_db.execute(create.value(), e.first.first, e.first.second, r.tempMin, r.tempMax);
+            if (!res) {
+                return res;
+            }
+            res = m_db.execute(update.value(), r.tempMin, r.tempMax, r.tempSum, r.samples, e.first.first, e.first.second);
+            if (!res) {
+                return res;
+            }
+        }
+        return true;
+    }
+
+    //binds the kBulkColumns values of one row of the bulk insert, starting at parameter idx.
+    //the statement has too many parameters for Statement::bind().
+    static int bindPoint(sqlite3_stmt *stmt, int idx, int64_t sensorID, const Point &p) {
+        int err_code = sqlite3_bind_int64(stmt, idx, p.timestamp);
+        if (err_code == SQLITE_OK) {
+            err_code = sqlite3_bind_double(stmt, idx + 1, p.temp);
+        }
+        if (err_code == SQLITE_OK) {
+            err_code = sqlite3_bind_int64(stmt, idx + 2, sensorID);
+        }
+        if (err_code == SQLITE_OK) {
+            err_code = sqlite3_bind_double(stmt, idx + 3, p.tempMin);
+        }
+        if (err_code == SQLITE_OK) {
+            err_code = sqlite3_bind_double(stmt, idx + 4, p.tempMax);
+        }
+        if (err_code == SQLITE_OK) {
+            err_code = sqlite3_bind_int64(stmt, idx + 5, p.samples);
+        }
+        return err_code;
+    }
+
+    status Store::addBulk(const IDBatch &points) {
+        //built once, the statement cache only needs it as the key
+        static const std::string sql = bulkInsertSQL(kBulkRows);
+        auto stmt = m_db.prepareCached(sql);
         if (!stmt) {
             return stmt.error();
         }
-        auto r = db.bindInteger(stmt.value(), ":timestamp",  now);
+        sqlite3_stmt *raw = stmt.value().stmt();
+
+        Rollups hourly;
+        Rollups daily;
+        for (const auto &p : points) {
+            int64_t ts = p.second.timestamp;
+            accumulate(hourly, p.first, ts - ts % kHour, p.second);
+            accumulate(daily, p.first, ts - ts % kDay, p.second);
+        }
+
+        auto r = m_db.begin();
+        if (!r) {
+            return r.error();
+        }
+
+        size_t i = 0;
+        for (; i + kBulkRows <= points.size(); i += kBulkRows) {
+            sqlite3_reset(raw);
+            int err_code = SQLITE_OK;
+            for (size_t j = i; j < i + kBulkRows && err_code == SQLITE_OK; j++) {
+                err_code = bindPoint(raw, (int)((j - i) * kBulkColumns) + 1, points[j].first, points[j].second);
+            }
+            if (err_code != SQLITE_OK) {
+                r = jsz::Error(err_code, __PRETTY_FUNCTION__, "bind value SQLite Error: " + std::string(sqlite3_errmsg(m_db.handle())));
+            } else {
+                r = m_db.execute(stmt.value());
+            }
+            if (!r) {
+                m_db.rollback();
+                return r.error();
+            }
+        }
+        for (; i < points.size(); i++) {
+            r = insert(points[i].first, points[i].second);
+            if (!r) {
+                m_db.rollback();
+                return r.error();
+            }
+        }
+
+        r = writeRollups("data_hourly", hourly);
+        if (r) {
+            r = writeRollups("data_daily", daily);
+        }
         if (!r) {
+            m_db.rollback();
             return r.error();
         }
-        r = db.bindDouble(stmt.value(), ":temp", temperature);
+
+        return m_db.commit();
+    }
+
+    //the indexes dropped by dropIndexes() are kept in pending_indexes until createIndexes() has
+    //run, so a load that dies half way doesn't leave the database without them: open() puts
+    //them back.
+    Result<std::vector<std::string>> Store::dropIndexes() {
+        //sql is NULL for the automatic indexes of UNIQUE/PRIMARY KEY constraints, those stay
+        auto indexes = m_db.query<std::string, std::string>("select name, sql from sqlite_master where type = 'index' and tbl_name = 'data' and sql is not null;");
+        if (!indexes) {
+            return indexes.error();
+        }
+
+        auto r = m_db.begin();
         if (!r) {
             return r.error();
         }
-        r = db.execute(stmt.value());
+        r = m_db.execute("create table if not exists pending_indexes (sql text NOT NULL);");
+        std::vector<std::string> created;
+        for (size_t i = 0; r && i < indexes.value().size(); i++) {
+            const auto &index = indexes.value()[i];
+            auto stmt = m_db.prepareCached("insert into pending_indexes (sql) values (?);");
+            r = stmt ? m_db.execute(stmt.value(), std::get<1>(index)) : status(stmt.error());
+            if (r) {
+                r = m_db.execute("drop index \"" + std::get<0>(index) + "\";");
+            }
+            created.push_back(std::get<1>(index));
+        }
         if (!r) {
+            m_db.rollback();
             return r.error();
         }
-        db.close();
-        
+        r = m_db.commit();
+        if (!r) {
+            m_db.rollback();
+            return r.error();
+        }
+        return created;
+    }
+
+    status Store::createIndexes(const std::vector<std::string> &indexes) {
+        auto r = m_db.begin();
+        if (!r) {
+            return r;
+        }
+        for (const auto &qry : indexes) {
+            r = m_db.execute(qry);
+            if (!r) {
+                m_db.rollback();
+                return r;
+            }
+        }
+        r = m_db.execute("drop table if exists pending_indexes;");
+        if (!r) {
+            m_db.rollback();
+            return r;
+        }
+        return m_db.commit();
+    }
+
+    //indexes left behind by a load that didn't finish, see dropIndexes()
+    status Store::restoreIndexes() {
+        auto pending = m_db.query<int64_t>("select count(*) from sqlite_master where type = 'table' and name = 'pending_indexes';");
+        if (!pending) {
+            return pending.error();
+        }
+        if (pending.value().empty() || std::get<0>(pending.value()[0]) == 0) {
+            return true;
+        }
+
+        auto indexes = m_db.query<std::string>("select sql from pending_indexes;");
+        if (!indexes) {
+            return indexes.error();
+        }
+        std::vector<std::string> sql;
+        for (const auto &index : indexes.value()) {
+            sql.push_back(std::get<0>(index));
+        }
+        return createIndexes(sql);
+    }
+
+#pragma mark - writer
+    //the shortest wait before a failed batch is written again
+    static const int kWriteRetryMs = 1000;
+
+    Writer::Writer(size_t maxBatch, int maxLatencyMs) : m_maxBatch(maxBatch > 0 ? maxBatch : 1),
+                                                      m_maxLatency(maxLatencyMs),
+                                                      m_retrying(false),
+                                                      m_flushRequested(false),
+                                                      m_busy(false),
+                                                      m_stop(false),
+                                                      m_generation(0),
+                                                      m_failedGeneration(0),
+                                                      m_error(true) {
+    }
+
+    Writer::~Writer() {
+        close();
+    }
+
+    status Writer::open(const Path path, const sql::Options &options) {
+        std::unique_ptr<Store> store(new Store());
+        auto r = store->open(path, options);
+        if (!r) {
+            return r.error();
+        }
+        return open(std::move(store));
+    }
+
+    status Writer::open(std::unique_ptr<Storage> storage) {
+        m_storage = std::move(storage);
+        m_stop = false;
+        m_thread = std::thread(&Writer::run, this);
         return true;
     }
-}
\ No newline at end of file
+
+    void Writer::close() {
+        if (!m_thread.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wakeup.notify_one();
+        m_thread.join();
+        m_storage->close();
+    }
+
+    void Writer::add(const std::string &sensorSerial, const Point &point) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        //back pressure: don't let the queue grow without bounds when the disk can't keep up
+        while (m_queue.size() >= m_maxBatch * 16 && !m_stop) {
+            m_written.wait(lock);
+        }
+
+        if (m_queue.empty()) {
+            m_oldest = std::chrono::steady_clock::now();
+        }
+        m_queue.push_back(std::make_pair(sensorSerial, point));
+
+        if (m_queue.size() >= m_maxBatch) {
+            m_wakeup.notify_one();
+        }
+    }
+
+    status Writer::flush() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_thread.joinable()) {
+            return jsz::Error(1, __PRETTY_FUNCTION__, "Writer is not open!");
+        }
+
+        uint64_t requested = m_generation;
+        m_flushRequested = true;
+        m_wakeup.notify_one();
+        //done when nothing is queued or in flight anymore - or a write after our request failed
+        while ((!m_queue.empty() || m_busy) && m_failedGeneration <= requested) {
+            m_written.wait(lock);
+        }
+
+        status e = m_error;
+        m_error = true;
+        return e;
+    }
+
+    status Writer::lastError() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        status e = m_error;
+        m_error = true;
+        return e;
+    }
+
+    void Writer::run() {
+        Batch batch;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            if (m_queue.empty()) {
+                m_flushRequested = false;
+                if (m_stop) {
+                    break;
+                }
+                m_wakeup.wait(lock);
+                continue;
+            }
+
+            //a full queue or a flush don't cut the backoff short, only shutting down does
+            if (m_retrying && !m_stop) {
+                if (std::chrono::steady_clock::now() < m_retryAt) {
+                    m_wakeup.wait_until(lock, m_retryAt);
+                    continue;
+                }
+            } else if (!m_stop && !m_flushRequested && m_queue.size() < m_maxBatch) {
+                auto deadline = m_oldest + m_maxLatency;
+                if (std::chrono::steady_clock::now() < deadline) {
+                    m_wakeup.wait_until(lock, deadline);
+                    continue;
+                }
+            }
+            m_retrying = false;
+
+            batch.clear();
+            batch.swap(m_queue);
+            m_flushRequested = false;
+            m_busy = true;
+            lock.unlock();
+
+            auto r = m_storage->addPoints(batch);
+
+            lock.lock();
+            m_busy = false;
+            m_generation++;
+            if (!r) {
+                m_error = r.error();
+                m_failedGeneration = m_generation;
+                //keep the points and try again after a backoff - unless we are shutting down.
+                //a full disk or a locked database won't be fixed by retrying right away.
+                if (!m_stop) {
+                    batch.insert(batch.end(), m_queue.begin(), m_queue.end());
+                    m_queue.swap(batch);
+                    m_oldest = std::chrono::steady_clock::now();
+                    m_retryAt = m_oldest + std::max(m_maxLatency, std::chrono::milliseconds(kWriteRetryMs));
+                    m_retrying = true;
+                }
+            }
+            m_written.notify_all();
+        }
+    }
+
+    status addEntry(double temperature) {
+        Store store;
+        auto res = store.open("temp.db");
+        if (!res) {
+            return res.error();
+        }
+
+        return store.addEntry(temperature);
+    }
+
+#pragma mark - zone map queries
+    //raw readings have no temp_min/temp_max, aggregated points (--persist-interval, compaction)
+    //only keep the mean in temp
+    static const char *kMatchColumns = "coalesce(s.serial, ''), d.timestamp, d.temp, coalesce(d.temp_min, d.temp), coalesce(d.temp_max, d.temp)";
+
+    Result<std::vector<int64_t>> findSensors(const sql::db &database, std::time_t from) {
+        auto sensors = database.query<int64_t>("select sensor_id from data_hourly where bucket > ? group by sensor_id;", (int64_t)from - kHour);
+        if (!sensors) {
+            return sensors.error();
+        }
+        std::vector<int64_t> ids;
+        for (const auto &sensor : sensors.value()) {
+            ids.push_back(std::get<0>(sensor));
+        }
+        return ids;
+    }
+
+    //cross join keeps data_hourly the outer loop, every matching hour is one range scan of the index.
+    //the unary + stops SQLite from building an automatic index on sensor_id instead.
+    Result<std::vector<Match>> findReadings(const sql::db &database, int64_t sensorID, double minTemp, double maxTemp, std::time_t from) {
+        return database.queryAs<Match>("select " + std::string(kMatchColumns) + " from data_hourly h cross join data d left join sensors s on s.id = d.sensor_id "
+                                       "where h.sensor_id = ? and h.bucket > ? and h.temp_max >= ? and h.temp_min <= ? "
+                                       "and d.timestamp >= h.bucket and d.timestamp < h.bucket + " + std::to_string(kHour) + " and +d.sensor_id = h.sensor_id "
+                                       "and d.timestamp >= ? and coalesce(d.temp_max, d.temp) >= ? and coalesce(d.temp_min, d.temp) <= ? order by d.timestamp;",
+                                       sensorID, (int64_t)from - kHour, minTemp, maxTemp, (int64_t)from, minTemp, maxTemp);
+    }
+
+    //the hours go by their bound, best first. the raw rows of an hour are only read while the
+    //hour can still beat the best reading so far - usually that's the first one.
+    Result<std::vector<Match>> findExtreme(const sql::db &database, int64_t sensorID, bool warmest, std::time_t from) {
+        auto hours = database.prepare(warmest ? "select bucket, temp_max from data_hourly where sensor_id = ? and bucket > ? order by temp_max desc;"
+                                              : "select bucket, temp_min from data_hourly where sensor_id = ? and bucket > ? order by temp_min;");
+        if (!hours) {
+            return hours.error();
+        }
+        auto r = hours.value().bind(sensorID, (int64_t)from - kHour);
+        if (!r) {
+            return r.error();
+        }
+
+        std::string readings = "select " + std::string(kMatchColumns) + " from data d left join sensors s on s.id = d.sensor_id "
+                               "where d.timestamp >= ? and d.timestamp < ? and d.sensor_id = ? ";
+        readings += warmest ? "order by coalesce(d.temp_max, d.temp) desc, d.timestamp limit 1;" : "order by coalesce(d.temp_min, d.temp), d.timestamp limit 1;";
+
+        auto value = [warmest](const Match &m) {
+            return warmest ? m.tempMax : m.tempMin;
+        };
+        std::vector<Match> found;
+        sql::Cursor rows(std::move(hours.value()));
+        for (auto &row : rows) {
+            int64_t bucket = row.getInteger(0).value_or(0);
+            double bound = row.getDouble(1).value_or(0.0);
+            if (!found.empty() && (warmest ? bound < value(found[0]) : bound > value(found[0]))) {
+                break;
+            }
+
+            auto match = database.queryAs<Match>(readings, std::max(bucket, (int64_t)from), bucket + kHour, sensorID);
+            if (!match) {
+                return match.error();
+            }
+            for (const auto &m : match.value()) {
+                if (found.empty()) {
+                    found.push_back(m);
+                } else if ((warmest ? value(m) > value(found[0]) : value(m) < value(found[0])) || (value(m) == value(found[0]) && m.timestamp < found[0].timestamp)) {
+                    found[0] = m;
+                }
+            }
+        }
+        if (!rows.error()) {
+            return rows.error().error();
+        }
+        return found;
+    }
+}
@@ -1,6 +1,174 @@
 #pragma once
 #include "Types.h"
+#include "CelSQL.h"
+#include <ctime>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
 
 namespace db {
+    //one stored data point. raw readings have tempMin == tempMax == temp and samples == 1,
+    //aggregated points carry the mean in temp and the timestamp of the start of their interval.
+    struct Point {
+        std::time_t timestamp;
+        double temp;
+        double tempMin;
+        double tempMax;
+        int64_t samples;
+    };
+
+    //points together with the serial of the probe they belong to
+    typedef std::vector<std::pair<std::string, Point>> Batch;
+
+    //points for bulk loading, the sensor id is already resolved (see Store::sensorID())
+    typedef std::vector<std::pair<int64_t, Point>> IDBatch;
+
+    //rollup buckets: data_hourly and data_daily keep one row per sensor and hour/day (UTC, bucket
+    //is the unix time of the start) so long ranges don't have to read every raw row.
+    //the mean is temp_sum / samples.
+    const int64_t kHour = 3600;
+    const int64_t kDay = 86400;
+
+    struct Rollup {
+        double tempMin;
+        double tempMax;
+        double tempSum;
+        int64_t samples;
+    };
+
+    //a stored reading found by findReadings() or findExtreme(). tempMin and tempMax are the
+    //range of an aggregated point, the same as temp for a single reading.
+    struct Match {
+        std::string serial;     //empty for rows from before multi sensor support
+        std::time_t timestamp;
+        double temp;
+        double tempMin;
+        double tempMax;
+    };
+
+    //where points end up: the SQLite database (Store) or the compressed time series
+    //file (TimeSeriesStore, see TimeSeries.h)
+    class Storage {
+    public:
+        virtual ~Storage() {
+        }
+
+        //either all points are stored or none
+        virtual status addPoints(const Batch &points) = 0;
+        virtual void close() = 0;
+    };
+
+    //keeps the database connection and the insert statement around between
+    //readings. use this when you write more than one entry per process.
+    class Store : public Storage {
+    public:
+        //creates the database if needed and migrates it to the current schema
+        status open(const Path path, const sql::Options &options = sql::Options::writer());
+        void close() override;
+
+        //sensorSerial identifies the probe - it is mapped to a row in the sensors table
+        status addEntry(const std::string &sensorSerial, double temperature, std::time_t timestamp);
+        status addPoint(const std::string &sensorSerial, const Point &point);
+        status addEntry(double temperature);
+
+        //writes all points in one transaction, together with the hourly and daily rollups.
+        //either all of them are stored or none.
+        status addPoints(const Batch &points) override;
+
+        //the id of the probe in the sensors table, the row is created on first use
+        Result<int64_t> sensorID(const std::string &serial);
+
+        //addPoints() for resolved sensor ids, many rows per insert statement
+        status addBulk(const IDBatch &points);
+
+        //drops the indexes on data and returns the SQL to create them again, so a large load
+        //doesn't update them row by row. if createIndexes() never runs (the load crashed), the
+        //next open() creates them.
+        Result<std::vector<std::string>> dropIndexes();
+        status createIndexes(const std::vector<std::string> &indexes);
+
+        //(sensor id, bucket) -> rollup
+        typedef std::map<std::pair<int64_t, int64_t>, Rollup> Rollups;
+
+    private:
+        status insert(int64_t sensorID, const Point &point);
+        status restoreIndexes();
+        status writeRollups(const std::string &table, const Rollups &rollups);
+
+        sql::db m_db;
+        sql::Statement m_insert;
+        std::map<std::string, int64_t> m_sensorIDs;
+    };
+
+    //group commit: points are queued and written by a background thread in one transaction
+    //once maxBatch points are queued or the oldest queued point waited maxLatencyMs, whatever
+    //comes first. this turns one fsync per reading into one fsync per batch.
+    class Writer {
+    public:
+        Writer(size_t maxBatch, int maxLatencyMs);
+        ~Writer();
+
+        Writer(const Writer &src) = delete;
+        Writer &operator=(const Writer &src) = delete;
+
+        status open(const Path path, const sql::Options &options = sql::Options::writer());
+        //writes to an already opened storage instead of the SQLite database
+        status open(std::unique_ptr<Storage> storage);
+        //writes everything that is still queued and stops the background thread
+        void close();
+
+        //blocks if the database falls too far behind
+        void add(const std::string &sensorSerial, const Point &point);
+
+        //writes everything queued so far and waits for it. returns the last write error, if any.
+        status flush();
+
+        //the last error of the background thread (true if there was none). clears it.
+        status lastError();
+
+    private:
+        void run();
+
+        std::unique_ptr<Storage> m_storage;
+        size_t m_maxBatch;
+        std::chrono::milliseconds m_maxLatency;
+
+        std::mutex m_mutex;
+        std::condition_variable m_wakeup;
+        std::condition_variable m_written;
+        Batch m_queue;
+        std::chrono::steady_clock::time_point m_oldest;
+        //after a failed write nothing is written before m_retryAt
+        std::chrono::steady_clock::time_point m_retryAt;
+        bool m_retrying;
+        bool m_flushRequested;
+        bool m_busy;
+        bool m_stop;
+        //number of batches written so far and the number of the last one that failed
+        uint64_t m_generation;
+        uint64_t m_failedGeneration;
+        status m_error;
+        std::thread m_thread;
+    };
+
     status addEntry(double temperature);
-}
\ No newline at end of file
+
+    //threshold and extreme queries use data_hourly as a zone map: only the hours whose
+    //temp_min/temp_max can match are read from data, through the (timestamp, temp) index.
+
+    //the sensors with rollups since from. the queries below run per sensor, so they can run
+    //side by side on different connections (see run_find() in main.cpp).
+    Result<std::vector<int64_t>> findSensors(const sql::db &database, std::time_t from);
+
+    //the readings of a sensor since from whose range overlaps [minTemp, maxTemp], in time order.
+    //aggregated points match on their min and max, not on the mean.
+    Result<std::vector<Match>> findReadings(const sql::db &database, int64_t sensorID, double minTemp, double maxTemp, std::time_t from);
+
+    //the lowest tempMin (or highest tempMax, if warmest) of a sensor since from and when it was
+    //first reached. empty if the sensor has no readings since from.
+    Result<std::vector<Match>> findExtreme(const sql::db &database, int64_t sensorID, bool warmest, std::time_t from);
+}
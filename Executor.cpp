@@ -0,0 +1,117 @@
+//
+//  Executor.cpp
+//  CelestialSQL
+//
+
+#include "Executor.h"
+
+    namespace sql {
+        Executor::Executor(Pool &pool) : m_pool(pool), m_stop(false) {
+            m_writes.threads.emplace_back(&Executor::runWrites, this);
+            for (size_t i = 0; i < pool.readerCount(); i++) {
+                m_reads.threads.emplace_back(&Executor::runReads, this);
+            }
+        }
+        
+        Executor::~Executor() {
+            close();
+        }
+        
+        void Executor::close() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_writes.ready.notify_all();
+            m_reads.ready.notify_all();
+            for (Lane *lane : {&m_writes, &m_reads}) {
+                for (auto &t : lane->threads) {
+                    t.join();
+                }
+                lane->threads.clear();
+            }
+        }
+        
+        bool Executor::push(Lane &lane, Job &&job) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_stop) {
+                    return false;
+                }
+                lane.jobs.push_back(std::move(job));
+            }
+            lane.ready.notify_one();
+            return true;
+        }
+        
+        //false once stopped and nothing is left
+        bool Executor::pop(Lane &lane, Job &job) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            lane.ready.wait(lock, [&]() {
+                return m_stop || !lane.jobs.empty();
+            });
+            if (lane.jobs.empty()) {
+                return false;
+            }
+            job = std::move(lane.jobs.front());
+            lane.jobs.pop_front();
+            return true;
+        }
+        
+        void Executor::runWrites() {
+            Job job;
+            while (pop(m_writes, job)) {
+                job(m_pool.writer());
+                job = Job();
+            }
+        }
+        
+        void Executor::runReads() {
+            Job job;
+            while (pop(m_reads, job)) {
+                auto connection = m_pool.reader();
+                job(*connection);
+                job = Job();
+            }
+        }
+        
+        std::future<status> Executor::execute(const std::string &query) {
+            return write([query](db &connection) {
+                return connection.execute(query);
+            });
+        }
+        
+        std::shared_future<Result<QueryResult>> Executor::query(const std::string &query) {
+            std::lock_guard<std::mutex> lock(m_inflightMutex);
+            auto it = m_inflight.find(query);
+            if (it != m_inflight.end()) {
+                return it->second;
+            }
+            
+            //the job removes the entry before it hands out the result - also when the query throws -
+            //so later calls see fresh data. a job that never runs never gets an entry.
+            auto promise = std::make_shared<std::promise<Result<QueryResult>>>();
+            std::shared_future<Result<QueryResult>> future = promise->get_future().share();
+            bool queued = push(m_reads, [this, query, promise](db &connection) {
+                try {
+                    auto result = connection.query(query);
+                    forget(query);
+                    promise->set_value(result);
+                } catch (...) {
+                    forget(query);
+                    promise->set_exception(std::current_exception());
+                }
+            });
+            if (!queued) {
+                promise->set_value(jsz::Error(kSQLErrorExecutorClosed, __PRETTY_FUNCTION__, "Executor is closed"));
+                return future;
+            }
+            m_inflight[query] = future;
+            return future;
+        }
+        
+        void Executor::forget(const std::string &query) {
+            std::lock_guard<std::mutex> lock(m_inflightMutex);
+            m_inflight.erase(query);
+        }
+    }
@@ -0,0 +1,87 @@
+//
+//  Executor.h
+//  CelestialSQL
+//
+
+#pragma once
+#include "CelSQL.h"
+#include <deque>
+#include <future>
+#include <thread>
+#include <map>
+
+    namespace sql {
+        const int kSQLErrorExecutorClosed = 58120;
+        
+        //runs database work on background threads and hands back futures.
+        //writes have their own lane: one thread on the pool's writer, in submission order, so
+        //they never queue behind long reads. reads are spread over one thread per pool reader.
+        //identical query() calls that are in flight at the same time run only once.
+        class Executor {
+        public:
+            //pool must stay open while the executor runs and have at least one reader for read()
+            Executor(Pool &pool);
+            ~Executor();
+            
+            Executor(const Executor &src) = delete;
+            Executor &operator=(const Executor &src) = delete;
+            
+            //runs what is queued and stops the threads. jobs added afterwards are dropped,
+            //their futures throw std::future_error (broken_promise).
+            void close();
+            
+            //f is called as f(db &) with the writer connection
+            template <class F>
+            std::future<typename std::result_of<F(db &)>::type> write(F f) {
+                return submit(m_writes, std::move(f));
+            }
+            
+            //f is called as f(db &) with a read-only connection checked out for the call
+            template <class F>
+            std::future<typename std::result_of<F(db &)>::type> read(F f) {
+                return submit(m_reads, std::move(f));
+            }
+            
+            std::future<status> execute(const std::string &query);
+            
+            //coalesced: callers asking for the same SQL while it runs share the result.
+            //after close() the result is a kSQLErrorExecutorClosed error.
+            std::shared_future<Result<QueryResult>> query(const std::string &query);
+            
+        private:
+            typedef std::function<void(db &)> Job;
+            
+            struct Lane {
+                std::deque<Job> jobs;
+                std::condition_variable ready;
+                std::vector<std::thread> threads;
+            };
+            
+            template <class F>
+            std::future<typename std::result_of<F(db &)>::type> submit(Lane &lane, F f) {
+                typedef typename std::result_of<F(db &)>::type R;
+                auto task = std::make_shared<std::packaged_task<R(db &)>>(std::move(f));
+                auto future = task->get_future();
+                push(lane, [task](db &connection) {
+                    (*task)(connection);
+                });
+                return future;
+            }
+            
+            //false if the executor is closed, the job is dropped then
+            bool push(Lane &lane, Job &&job);
+            bool pop(Lane &lane, Job &job);
+            void runWrites();
+            void runReads();
+            void forget(const std::string &query);
+            
+            Pool &m_pool;
+            std::mutex m_mutex;
+            bool m_stop;
+            Lane m_writes;
+            Lane m_reads;
+            
+            std::mutex m_inflightMutex;
+            std::map<std::string, std::shared_future<Result<QueryResult>>> m_inflight;
+        };
+    }
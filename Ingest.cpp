@@ -0,0 +1,396 @@
+#include "Ingest.h"
+#include "Migrations.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+#include <chrono>
+#include <memory>
+
+namespace ingest {
+    Result<Format> formatNamed(const std::string &name) {
+        if (name == "csv") {
+            return Format::CSV;
+        }
+        if (name == "bin") {
+            return Format::Binary;
+        }
+        if (name == "sql") {
+            return Format::SQL;
+        }
+        return jsz::Error(kIngestErrorFormat, __PRETTY_FUNCTION__, "Unknown import format: " + name);
+    }
+
+    Format formatForPath(const Path &path) {
+        std::string p = path.to_string();
+        size_t dot = p.rfind('.');
+        if (dot != std::string::npos) {
+            auto format = formatNamed(p.substr(dot + 1));
+            if (format) {
+                return format.value();
+            }
+        }
+        return Format::CSV;
+    }
+
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static db::Point rawPoint(int64_t timestamp, double temp) {
+        db::Point p;
+        p.timestamp = (std::time_t)timestamp;
+        p.temp = temp;
+        p.tempMin = temp;
+        p.tempMax = temp;
+        p.samples = 1;
+        return p;
+    }
+
+    //collects rows and writes them in transactions of rowsPerTransaction rows
+    class Loader {
+    public:
+        Loader(db::Store &store, const std::string &defaultSerial, size_t rowsPerTransaction) : m_store(store), m_defaultSerial(defaultSerial), m_defaultID(-1), m_lastID(-1), m_rowsPerTransaction(rowsPerTransaction > 0 ? rowsPerTransaction : 1), m_rows(0) {
+            m_batch.reserve(m_rowsPerTransaction);
+        }
+
+        status add(int64_t timestamp, double temp, const char *serial, size_t serialLength) {
+            int64_t sid;
+            if (serialLength == 0) {
+                auto r = defaultID();
+                if (!r) {
+                    return r.error();
+                }
+                sid = r.value();
+            } else {
+                //input is usually sorted by sensor or comes from one sensor only
+                if (m_lastID < 0 || m_lastSerial.size() != serialLength || memcmp(m_lastSerial.data(), serial, serialLength) != 0) {
+                    m_lastSerial.assign(serial, serialLength);
+                    auto r = m_store.sensorID(m_lastSerial);
+                    if (!r) {
+                        return r.error();
+                    }
+                    m_lastID = r.value();
+                }
+                sid = m_lastID;
+            }
+
+            m_batch.push_back(std::make_pair(sid, rawPoint(timestamp, temp)));
+            if (m_batch.size() >= m_rowsPerTransaction) {
+                return flush();
+            }
+            return true;
+        }
+
+        status flush() {
+            if (m_batch.empty()) {
+                return true;
+            }
+            auto r = m_store.addBulk(m_batch);
+            if (!r) {
+                return r.error();
+            }
+            m_rows += m_batch.size();
+            m_batch.clear();
+            return true;
+        }
+
+        uint64_t rows() const {
+            return m_rows;
+        }
+
+    private:
+        Result<int64_t> defaultID() {
+            if (m_defaultID < 0) {
+                if (m_defaultSerial.empty()) {
+                    m_defaultID = 0;
+                } else {
+                    auto r = m_store.sensorID(m_defaultSerial);
+                    if (!r) {
+                        return r.error();
+                    }
+                    m_defaultID = r.value();
+                }
+            }
+            return m_defaultID;
+        }
+
+        db::Store &m_store;
+        std::string m_defaultSerial;
+        int64_t m_defaultID;
+        std::string m_lastSerial;
+        int64_t m_lastID;
+        size_t m_rowsPerTransaction;
+        db::IDBatch m_batch;
+        uint64_t m_rows;
+    };
+
+    static bool isSeparator(char c) {
+        return c == ',' || c == ';' || c == '|' || c == '\t';
+    }
+
+    //up to maxDigits digits at p, not past end
+    static bool parseDigits(const char *&p, const char *end, int maxDigits, int &value) {
+        const char *start = p;
+        value = 0;
+        while (p < end && p - start < maxDigits && isdigit((unsigned char)*p)) {
+            value = value * 10 + (*p - '0');
+            p++;
+        }
+        return p > start;
+    }
+
+    //"YYYY-MM-DD HH:MM:SS" in local time. mktime() is far too slow to run for every line, so it
+    //only runs once per hour of readings: time zone offsets change on the hour.
+    class LocalTime {
+    public:
+        LocalTime() : m_hour(-1), m_start(0) {
+        }
+
+        bool parse(const char *&p, const char *end, int64_t &timestamp) {
+            int year, month, day, hour, minute, second;
+            if (!parseDigits(p, end, 4, year) || p >= end || *p++ != '-' ||
+                !parseDigits(p, end, 2, month) || p >= end || *p++ != '-' ||
+                !parseDigits(p, end, 2, day) || p >= end || *p != ' ') {
+                return false;
+            }
+            while (p < end && *p == ' ') {
+                p++;
+            }
+            if (!parseDigits(p, end, 2, hour) || p >= end || *p++ != ':' ||
+                !parseDigits(p, end, 2, minute) || p >= end || *p++ != ':' ||
+                !parseDigits(p, end, 2, second)) {
+                return false;
+            }
+            if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+                return false;
+            }
+
+            int64_t key = (((int64_t)year * 12 + month) * 31 + day) * 24 + hour;
+            if (key != m_hour) {
+                std::tm tm;
+                memset(&tm, 0, sizeof(tm));
+                tm.tm_year = year - 1900;
+                tm.tm_mon = month - 1;
+                tm.tm_mday = day;
+                tm.tm_hour = hour;
+                tm.tm_isdst = -1;
+                m_start = (int64_t)mktime(&tm);
+                m_hour = key;
+            }
+            timestamp = m_start + minute * 60 + second;
+            return true;
+        }
+
+    private:
+        int64_t m_hour;     //year, month, day and hour of m_start
+        int64_t m_start;
+    };
+
+    //one CSV line without the line break. returns false if it is not a reading.
+    static bool parseLine(const char *line, const char *end, LocalTime &localTime, int64_t &timestamp, double &temp, const char *&serial, size_t &serialLength) {
+        if (line == end || !isdigit((unsigned char)*line)) {
+            return false;
+        }
+
+        char *next;
+        timestamp = strtoll(line, &next, 10);
+        if (next < end && *next == '-') {
+            const char *p = line;
+            if (!localTime.parse(p, end, timestamp)) {
+                return false;
+            }
+            next = (char *)p;
+        }
+        if (next >= end || !isSeparator(*next)) {
+            return false;
+        }
+
+        const char *field = next + 1;
+        temp = strtod(field, &next);
+        if (next == field || next > end) {
+            return false;
+        }
+
+        serial = next;
+        serialLength = 0;
+        if (next < end && isSeparator(*next)) {
+            serial = next + 1;
+            const char *stop = serial;
+            while (stop < end && !isSeparator(*stop)) {
+                stop++;
+            }
+            while (stop > serial && isspace((unsigned char)stop[-1])) {
+                stop--;
+            }
+            serialLength = (size_t)(stop - serial);
+        }
+        return true;
+    }
+
+    static status loadCSV(FILE *in, Loader &loader, uint64_t &bytes) {
+        std::vector<char> buf(4 * 1024 * 1024 + 1);
+        size_t kept = 0;    //start of an unfinished line from the last block
+        uint64_t lineNumber = 0;
+        LocalTime localTime;
+
+        for (;;) {
+            size_t r = fread(buf.data() + kept, 1, buf.size() - 1 - kept, in);
+            bool last = r == 0;
+            bytes += r;
+            size_t filled = kept + r;
+            if (last) {
+                if (kept == 0) {
+                    break;
+                }
+                //the last line has no line break
+                buf[filled++] = '\n';
+            }
+            //strtod/strtoll must not run past the block
+            buf[filled] = 0;
+
+            const char *p = buf.data();
+            const char *end = buf.data() + filled;
+            for (;;) {
+                const char *eol = (const char *)memchr(p, '\n', (size_t)(end - p));
+                if (!eol) {
+                    break;
+                }
+                lineNumber++;
+                const char *lineEnd = eol;
+                if (lineEnd > p && lineEnd[-1] == '\r') {
+                    lineEnd--;
+                }
+
+                int64_t timestamp;
+                double temp;
+                const char *serial;
+                size_t serialLength;
+                if (parseLine(p, lineEnd, localTime, timestamp, temp, serial, serialLength)) {
+                    auto s = loader.add(timestamp, temp, serial, serialLength);
+                    if (!s) {
+                        return s.error();
+                    }
+                } else if (p != lineEnd && isdigit((unsigned char)*p)) {
+                    return jsz::Error(kIngestErrorParse, __PRETTY_FUNCTION__, "Can not parse line " + std::to_string(lineNumber) + ": " + std::string(p, lineEnd));
+                }
+                p = eol + 1;
+            }
+
+            kept = (size_t)(end - p);
+            if (kept == buf.size() - 1) {
+                return jsz::Error(kIngestErrorParse, __PRETTY_FUNCTION__, "Line " + std::to_string(lineNumber + 1) + " is too long");
+            }
+            memmove(buf.data(), p, kept);
+            if (last) {
+                break;
+            }
+        }
+
+        if (ferror(in)) {
+            return jsz::Error(kIngestErrorRead, __PRETTY_FUNCTION__, "Read error");
+        }
+        return loader.flush();
+    }
+
+    static status loadBinary(FILE *in, Loader &loader, uint64_t &bytes) {
+        std::vector<BinaryRecord> buf(256 * 1024);
+        for (;;) {
+            size_t r = fread(buf.data(), sizeof(BinaryRecord), buf.size(), in);
+            if (r == 0) {
+                break;
+            }
+            bytes += r * sizeof(BinaryRecord);
+            for (size_t i = 0; i < r; i++) {
+                auto s = loader.add(buf[i].timestamp, buf[i].temp, nullptr, 0);
+                if (!s) {
+                    return s.error();
+                }
+            }
+        }
+
+        if (ferror(in)) {
+            return jsz::Error(kIngestErrorRead, __PRETTY_FUNCTION__, "Read error");
+        }
+        return loader.flush();
+    }
+
+    //a dump creates its own tables, so it only goes into a new (empty) database. whatever schema
+    //version the dump was taken at, it is migrated to the current one afterwards.
+    static Result<Stats> importDump(const Path &dbPath, const Path &input, size_t statementsPerTransaction) {
+        auto start = std::chrono::steady_clock::now();
+        sql::db database;
+        auto r = database.initWithPath(dbPath, true, sql::Options::writer());
+        if (!r) {
+            return r.error();
+        }
+
+        auto tables = database.query<int64_t>("select count(*) from sqlite_master;");
+        if (!tables) {
+            return tables.error();
+        }
+        if (!tables.value().empty() && std::get<0>(tables.value()[0]) > 0) {
+            return jsz::Error(kIngestErrorTarget, __PRETTY_FUNCTION__, dbPath.to_string() + " is not empty, a SQL dump can only be imported into a new database");
+        }
+
+        Stats stats = {0, 0, 0.0};
+        r = database.importDump(input, statementsPerTransaction, [&stats](uint64_t bytes, uint64_t statements) {
+            stats.bytes = bytes;
+            stats.rows = statements;
+        });
+        if (!r) {
+            return r.error();
+        }
+        r = db::migrate(database);
+        if (!r) {
+            return r.error();
+        }
+        stats.seconds = secondsSince(start);
+        return stats;
+    }
+
+    Result<Stats> importFile(const Path &dbPath, const Path &input, Format format, const std::string &defaultSerial, size_t rowsPerTransaction) {
+        if (format == Format::SQL) {
+            return importDump(dbPath, input, rowsPerTransaction);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<FILE, int (*)(FILE *)> in(fopen(input.to_string().c_str(), "rb"), fclose);
+        if (!in) {
+            return jsz::Error(kIngestErrorRead, __PRETTY_FUNCTION__, "Couldn't open file for reading: " + input.to_string());
+        }
+
+        db::Store store;
+        auto r = store.open(dbPath);
+        if (!r) {
+            return r.error();
+        }
+
+        auto indexes = store.dropIndexes();
+        if (!indexes) {
+            return indexes.error();
+        }
+
+        Loader loader(store, defaultSerial, rowsPerTransaction);
+        Stats stats = {0, 0, 0.0};
+        if (format == Format::Binary) {
+            r = loadBinary(in.get(), loader, stats.bytes);
+        } else {
+            r = loadCSV(in.get(), loader, stats.bytes);
+        }
+
+        //the indexes come back even if the load failed half way
+        auto created = store.createIndexes(indexes.value());
+        if (!r) {
+            return r.error();
+        }
+        if (!created) {
+            return created.error();
+        }
+
+        stats.rows = loader.rows();
+        stats.seconds = secondsSince(start);
+        return stats;
+    }
+}
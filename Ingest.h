@@ -0,0 +1,43 @@
+#pragma once
+#include "Types.h"
+#include "Database.h"
+#include <cstdint>
+#include <string>
+
+//bulk loading of readings from other loggers into the database
+namespace ingest {
+    const int kIngestErrorFormat = 1;
+    const int kIngestErrorRead = 2;
+    const int kIngestErrorParse = 3;
+    const int kIngestErrorTarget = 4;
+
+    //CSV: one reading per line as timestamp,temp[,serial]. timestamp is unix seconds or
+    //  "YYYY-MM-DD HH:MM:SS" local time (what --export prints), the separator may be , ; | or tab.
+    //  lines not starting with a digit (headers) are skipped.
+    //Binary: BinaryRecord after BinaryRecord in host byte order.
+    //SQL: a dump, see sql::db::importDump(). only into a new database, it is migrated afterwards.
+    enum class Format {
+        CSV,
+        Binary,
+        SQL
+    };
+
+    struct BinaryRecord {
+        int64_t timestamp;  //unix seconds
+        double temp;
+    };
+
+    Result<Format> formatNamed(const std::string &name);
+    //by file extension (.csv, .bin, .sql), CSV if unknown
+    Format formatForPath(const Path &path);
+
+    struct Stats {
+        uint64_t rows;      //statements for SQL
+        uint64_t bytes;
+        double seconds;
+    };
+
+    //readings without a serial go to defaultSerial, or sensor 0 if that is empty.
+    //the indexes on data are dropped for the load and created again afterwards.
+    Result<Stats> importFile(const Path &dbPath, const Path &input, Format format, const std::string &defaultSerial, size_t rowsPerTransaction = 500000);
+}
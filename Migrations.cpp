@@ -0,0 +1,157 @@
+#include "Migrations.h"
+#include "Database.h"
+
+namespace db {
+    static Result<bool> hasColumn(sql::db &database, const std::string &table, const std::string &column) {
+        auto info = database.cursor("pragma table_info(" + table + ");");
+        if (!info) {
+            return info.error();
+        }
+        for (auto &row : info.value()) {
+            if (row.getTextView(1).value_or(sql::TextView()) == column) {
+                return true;
+            }
+        }
+        if (!info.value().error()) {
+            return info.value().error().error();
+        }
+        return false;
+    }
+
+    //runs the statements unless table already has column
+    static status addColumnsUnless(sql::db &database, const std::string &table, const std::string &column, const std::vector<std::string> &statements) {
+        auto exists = hasColumn(database, table, column);
+        if (!exists) {
+            return exists.error();
+        }
+        if (exists.value()) {
+            return true;
+        }
+        for (const auto &qry : statements) {
+            auto r = database.execute(qry);
+            if (!r) {
+                return r;
+            }
+        }
+        return true;
+    }
+
+    static status createTables(sql::db &database) {
+        auto r = database.execute("create table if not exists sensors (id integer primary key, serial text NOT NULL UNIQUE);");
+        if (!r) {
+            return r;
+        }
+        //the original layout, the columns added later come from the next steps
+        return database.execute("create table if not exists data (id integer primary key, timestamp integer NOT NULL, temp real NOT NULL);");
+    }
+
+    //multi sensor support (was upgrade_sensors.sql)
+    static status addSensorColumn(sql::db &database) {
+        return addColumnsUnless(database, "data", "sensor_id", {
+            "alter table data add column sensor_id integer NOT NULL DEFAULT 0;"
+        });
+    }
+
+    //aggregated points (was upgrade_aggregates.sql)
+    static status addAggregateColumns(sql::db &database) {
+        return addColumnsUnless(database, "data", "samples", {
+            "alter table data add column temp_min real;",
+            "alter table data add column temp_max real;",
+            "alter table data add column samples integer NOT NULL DEFAULT 1;"
+        });
+    }
+
+    //every script filters or sorts by timestamp and reads temp - covered by the index alone
+    static status addTimestampIndex(sql::db &database) {
+        return database.execute("create index if not exists data_timestamp_temp on data (timestamp, temp);");
+    }
+
+    static status addRollups(sql::db &database) {
+        for (const char *table : {"data_hourly", "data_daily"}) {
+            auto r = database.execute("create table if not exists " + std::string(table) + " (sensor_id integer NOT NULL, bucket integer NOT NULL, temp_min real NOT NULL, temp_max real NOT NULL, temp_sum real NOT NULL, samples integer NOT NULL, primary key (sensor_id, bucket));");
+            if (!r) {
+                return r;
+            }
+        }
+
+        //backfill from the raw rows. rows from before aggregated points have no min/max.
+        //the tables may exist already without user_version saying so (e.g. a database loaded from
+        //a .dump), their rows are rebuilt then.
+        std::vector<std::pair<std::string, int64_t>> rollups = {{"data_hourly", kHour}, {"data_daily", kDay}};
+        for (const auto &rollup : rollups) {
+            std::string bucket = "timestamp - timestamp % " + std::to_string(rollup.second);
+            auto r = database.execute("delete from " + rollup.first + ";");
+            if (!r) {
+                return r;
+            }
+            r = database.execute("insert into " + rollup.first + " (sensor_id, bucket, temp_min, temp_max, temp_sum, samples) "
+                                      "select sensor_id, " + bucket + ", min(coalesce(temp_min, temp)), max(coalesce(temp_max, temp)), sum(temp * samples), sum(samples) "
+                                      "from data group by sensor_id, " + bucket + ";");
+            if (!r) {
+                return r;
+            }
+        }
+        return true;
+    }
+
+    struct Migration {
+        int version;
+        status (*apply)(sql::db &database);
+    };
+
+    //append only - never change or reorder steps that shipped
+    static const Migration kMigrations[] = {
+        {1, createTables},
+        {2, addSensorColumn},
+        {3, addAggregateColumns},
+        {4, addTimestampIndex},
+        {5, addRollups},
+    };
+
+    int latestSchemaVersion() {
+        return kMigrations[sizeof(kMigrations) / sizeof(kMigrations[0]) - 1].version;
+    }
+
+    Result<int> schemaVersion(sql::db &database) {
+        auto version = database.query<int64_t>("pragma user_version;");
+        if (!version) {
+            return version.error();
+        }
+        if (version.value().empty()) {
+            return jsz::Error(1, __PRETTY_FUNCTION__, "No user_version");
+        }
+        return (int)std::get<0>(version.value()[0]);
+    }
+
+    status migrate(sql::db &database) {
+        auto version = schemaVersion(database);
+        if (!version) {
+            return version.error();
+        }
+
+        for (const auto &m : kMigrations) {
+            if (m.version <= version.value()) {
+                continue;
+            }
+
+            auto r = database.begin();
+            if (!r) {
+                return r;
+            }
+            r = m.apply(database);
+            if (r) {
+                //pragmas can't take parameters
+                r = database.execute("pragma user_version = " + std::to_string(m.version) + ";");
+            }
+            if (!r) {
+                database.rollback();
+                return jsz::Error(r.error().code, __PRETTY_FUNCTION__, "Migration to schema version " + std::to_string(m.version) + " failed: " + r.error().description());
+            }
+            r = database.commit();
+            if (!r) {
+                return r;
+            }
+        }
+        return true;
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "Types.h"
+#include "CelSQL.h"
+
+namespace db {
+    //the schema version a database has after migrate()
+    int latestSchemaVersion();
+
+    //PRAGMA user_version of the database
+    Result<int> schemaVersion(sql::db &database);
+
+    //brings the schema up to date, one transaction per step. each step bumps user_version, so
+    //only missing steps run. databases from before the versioning (user_version 0, any of the
+    //older schemas) are detected by their columns and upgraded as well.
+    status migrate(sql::db &database);
+}
@@ -0,0 +1,236 @@
+#include "Recent.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+#include <chrono>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace sampler {
+    //a client that stops reading doesn't block the server for longer than this
+    static const int kRecentTimeoutSeconds = 2;
+
+    std::string recentSocketPath(const std::string &dbPath) {
+        return dbPath + ".sock";
+    }
+
+    std::string formatSamples(const Sampler &sampler, const std::vector<Sample> &samples) {
+        std::string text;
+        std::vector<std::string> sensorIDs;
+        for (const auto &s : samples) {
+            while (sensorIDs.size() <= s.sensor) {
+                sensorIDs.push_back(sampler.sensorID((uint32_t)sensorIDs.size()));
+            }
+
+            std::time_t when = (std::time_t)(s.timestamp / 1000);
+            std::tm loctm;
+            localtime_r(&when, &loctm);
+            char date[32];
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &loctm);
+            char line[64];
+            snprintf(line, sizeof(line), "%s.%03d|%.2f|", date, (int)(s.timestamp % 1000), s.temp);
+            text += line;
+            text += sensorIDs[s.sensor];
+            text += '\n';
+        }
+        return text;
+    }
+
+    static status socketAddress(const std::string &path, sockaddr_un &addr) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            return jsz::Error(kRecentErrorSocket, __PRETTY_FUNCTION__, "Socket path too long: " + path);
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    static void setTimeouts(int fd) {
+        timeval tv;
+        tv.tv_sec = kRecentTimeoutSeconds;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+
+#pragma mark - server
+    RecentServer::RecentServer(const Sampler &sampler) : m_sampler(sampler), m_listen(-1) {
+        m_wakeup[0] = -1;
+        m_wakeup[1] = -1;
+    }
+
+    RecentServer::~RecentServer() {
+        stop();
+    }
+
+    status RecentServer::start(const std::string &path) {
+        sockaddr_un addr;
+        auto r = socketAddress(path, addr);
+        if (!r) {
+            return r;
+        }
+
+        m_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_listen < 0) {
+            return jsz::Error(kRecentErrorSocket, __PRETTY_FUNCTION__, std::string("Couldn't create socket: ") + strerror(errno));
+        }
+        //left over from a daemon that didn't shut down cleanly
+        unlink(path.c_str());
+        if (bind(m_listen, (const sockaddr *)&addr, sizeof(addr)) != 0 || listen(m_listen, 4) != 0 || pipe(m_wakeup) != 0) {
+            int err = errno;
+            stop();
+            return jsz::Error(kRecentErrorSocket, __PRETTY_FUNCTION__, "Couldn't listen on " + path + ": " + strerror(err));
+        }
+        m_path = path;
+        m_thread = std::thread(&RecentServer::loop, this);
+        return true;
+    }
+
+    void RecentServer::stop() {
+        if (m_thread.joinable()) {
+            char c = 0;
+            while (write(m_wakeup[1], &c, 1) < 0 && errno == EINTR) {
+            }
+            m_thread.join();
+        }
+        for (int &fd : m_wakeup) {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        if (m_listen >= 0) {
+            ::close(m_listen);
+            m_listen = -1;
+        }
+        if (!m_path.empty()) {
+            unlink(m_path.c_str());
+            m_path.clear();
+        }
+    }
+
+    void RecentServer::loop() {
+        for (;;) {
+            pollfd fds[2] = {{m_listen, POLLIN, 0}, {m_wakeup[0], POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (fds[1].revents != 0) {
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(m_listen, nullptr, nullptr);
+                if (fd >= 0) {
+                    serve(fd);
+                    ::close(fd);
+                }
+            }
+        }
+    }
+
+    //the request is the number of seconds and a line break, the answer the samples as
+    //formatSamples() formats them
+    void RecentServer::serve(int fd) {
+        setTimeouts(fd);
+
+        char request[32];
+        size_t length = 0;
+        while (length < sizeof(request) - 1) {
+            ssize_t r = read(fd, request + length, sizeof(request) - 1 - length);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                break;
+            }
+            length += (size_t)r;
+            if (memchr(request, '\n', length)) {
+                break;
+            }
+        }
+        request[length] = 0;
+
+        char *end;
+        long long seconds = strtoll(request, &end, 10);
+        if (end == request || seconds <= 0) {
+            return;
+        }
+
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        auto samples = m_sampler.recent(now - (int64_t)seconds * 1000);
+
+        std::string text = formatSamples(m_sampler, samples);
+#ifdef MSG_NOSIGNAL
+        int flags = MSG_NOSIGNAL;   //a client that went away must not kill the daemon with SIGPIPE
+#else
+        int flags = 0;
+#endif
+        size_t sent = 0;
+        while (sent < text.size()) {
+            ssize_t n = send(fd, text.data() + sent, text.size() - sent, flags);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return;
+            }
+            sent += (size_t)n;
+        }
+    }
+
+#pragma mark - client
+    status queryRecent(const std::string &path, int64_t seconds, FILE *out) {
+        sockaddr_un addr;
+        auto r = socketAddress(path, addr);
+        if (!r) {
+            return r;
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return jsz::Error(kRecentErrorSocket, __PRETTY_FUNCTION__, std::string("Couldn't create socket: ") + strerror(errno));
+        }
+        if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0) {
+            int err = errno;
+            ::close(fd);
+            return jsz::Error(kRecentErrorSocket, __PRETTY_FUNCTION__, "Couldn't connect to " + path + " (is tempserv --daemon running?): " + strerror(err));
+        }
+
+        std::string request = std::to_string(seconds) + "\n";
+        if (write(fd, request.data(), request.size()) != (ssize_t)request.size()) {
+            int err = errno;
+            ::close(fd);
+            return jsz::Error(kRecentErrorIO, __PRETTY_FUNCTION__, "Couldn't send the request to " + path + ": " + strerror(err));
+        }
+
+        char buf[64 * 1024];
+        for (;;) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                int err = errno;
+                ::close(fd);
+                return jsz::Error(kRecentErrorIO, __PRETTY_FUNCTION__, "Couldn't read from " + path + ": " + strerror(err));
+            }
+            if (n == 0) {
+                break;
+            }
+            fwrite(buf, 1, (size_t)n, out);
+        }
+        ::close(fd);
+        return true;
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "Types.h"
+#include "Sampler.h"
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+
+//the raw samples of a running daemon: it answers on a unix socket next to the database
+//(<db>.sock), tempserv --recent <seconds> asks it for the samples of the last seconds.
+//only one daemon per database, a second one takes the socket over.
+namespace sampler {
+    const int kRecentErrorSocket = 1;
+    const int kRecentErrorIO = 2;
+
+    //where the daemon writing to dbPath listens
+    std::string recentSocketPath(const std::string &dbPath);
+
+    //"YYYY-MM-DD HH:MM:SS.mmm|temp|serial" per sample, local time
+    std::string formatSamples(const Sampler &sampler, const std::vector<Sample> &samples);
+
+    //answers Sampler::recent() queries on a thread of its own, one client at a time.
+    //the samples are copied under the sampler's lock and sent without it.
+    class RecentServer {
+    public:
+        explicit RecentServer(const Sampler &sampler);
+        ~RecentServer();
+
+        RecentServer(const RecentServer &src) = delete;
+        RecentServer &operator=(const RecentServer &src) = delete;
+
+        status start(const std::string &path);
+        void stop();
+
+    private:
+        void loop();
+        void serve(int fd);
+
+        const Sampler &m_sampler;
+        std::string m_path;
+        int m_listen;
+        int m_wakeup[2];    //a byte in here stops loop()
+        std::thread m_thread;
+    };
+
+    //writes the samples of the last seconds of the daemon listening at path to out
+    status queryRecent(const std::string &path, int64_t seconds, FILE *out);
+}
@@ -0,0 +1,312 @@
+#include "Retention.h"
+#include "Database.h"
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+#include <chrono>
+
+namespace db {
+    //pages per PRAGMA incremental_vacuum, each call is a short write transaction of its own
+    static const int kVacuumPages = 1024;
+
+    static int64_t alignDown(int64_t timestamp, int64_t interval) {
+        return timestamp - timestamp % interval;
+    }
+
+#pragma mark - policy
+    RetentionPolicy RetentionPolicy::standard() {
+        RetentionPolicy policy;
+        policy.tiers.push_back(RetentionTier{30 * kDay, 5 * 60});
+        policy.tiers.push_back(RetentionTier{365 * kDay, kHour});
+        return policy;
+    }
+
+    //"30d", "5m", ... in seconds, 0 if invalid
+    static int64_t parseDuration(const std::string &s) {
+        char *end = nullptr;
+        long long n = strtoll(s.c_str(), &end, 10);
+        if (end == s.c_str() || n <= 0) {
+            return 0;
+        }
+        std::string unit(end);
+        if (unit == "s" || unit.empty()) {
+            return n;
+        } else if (unit == "m") {
+            return n * 60;
+        } else if (unit == "h") {
+            return n * kHour;
+        } else if (unit == "d") {
+            return n * kDay;
+        } else if (unit == "y") {
+            return n * 365 * kDay;
+        }
+        return 0;
+    }
+
+    Result<RetentionPolicy> RetentionPolicy::parse(const std::string &spec) {
+        RetentionPolicy policy;
+        size_t pos = 0;
+        while (pos <= spec.size()) {
+            size_t comma = spec.find(',', pos);
+            std::string tier = spec.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+            size_t colon = tier.find(':');
+            int64_t age = colon == std::string::npos ? 0 : parseDuration(tier.substr(0, colon));
+            int64_t interval = colon == std::string::npos ? 0 : parseDuration(tier.substr(colon + 1));
+            if (age == 0 || interval == 0) {
+                return jsz::Error(kRetentionErrorPolicy, __PRETTY_FUNCTION__, "Invalid retention tier \"" + tier + "\", expected <age>:<interval>");
+            }
+
+            if (kHour % interval != 0) {
+                return jsz::Error(kRetentionErrorPolicy, __PRETTY_FUNCTION__, "Retention interval of \"" + tier + "\" doesn't divide an hour");
+            }
+            if (!policy.tiers.empty()) {
+                const RetentionTier &last = policy.tiers.back();
+                if (age <= last.age || interval <= last.interval || interval % last.interval != 0) {
+                    return jsz::Error(kRetentionErrorPolicy, __PRETTY_FUNCTION__, "Retention tier \"" + tier + "\" must be older than the one before, with a longer interval that is a multiple of its interval");
+                }
+            }
+            policy.tiers.push_back(RetentionTier{age, interval});
+
+            if (comma == std::string::npos) {
+                break;
+            }
+            pos = comma + 1;
+        }
+        return policy;
+    }
+
+#pragma mark - compactor
+    Compactor::Compactor(const RetentionPolicy &policy, size_t rowsPerTransaction) : m_policy(policy),
+                                                                                   m_rowsPerTransaction(rowsPerTransaction > 0 ? rowsPerTransaction : 1),
+                                                                                   m_done(policy.tiers.size(), INT64_MIN),
+                                                                                   m_stop(false),
+                                                                                   m_error(true) {
+    }
+
+    Compactor::~Compactor() {
+        stop();
+        close();
+    }
+
+    //expects a migrated database, the daemon's Store takes care of that
+    status Compactor::open(const Path path, const sql::Options &options) {
+        auto r = m_db.initWithPath(path, false, options);
+        if (!r) {
+            return r;
+        }
+        //the merged points of one transaction, by sensor and bucket
+        return m_db.execute("create temp table if not exists compact_points (sensor_id integer NOT NULL, bucket integer NOT NULL, temp real NOT NULL, "
+                            "temp_min real NOT NULL, temp_max real NOT NULL, samples integer NOT NULL, primary key (sensor_id, bucket));");
+    }
+
+    void Compactor::close() {
+        m_db.close();
+        m_done.assign(m_policy.tiers.size(), INT64_MIN);
+    }
+
+    //the oldest tier goes first. a younger tier starts where the older one stopped: everything
+    //before that has been merged into even longer intervals already.
+    Result<CompactionStats> Compactor::run(std::time_t now) {
+        CompactionStats stats = {0, 0, 0};
+        int64_t olderCutoff = INT64_MIN;
+        for (size_t i = m_policy.tiers.size(); i-- > 0;) {
+            const RetentionTier &tier = m_policy.tiers[i];
+            int64_t cutoff = alignDown((int64_t)now - tier.age, tier.interval);
+            int64_t from = std::max(olderCutoff, m_done[i]);
+
+            auto r = compactTier(tier, from, cutoff, stats);
+            if (!r) {
+                return r.error();
+            }
+            m_done[i] = std::max(from, cutoff);
+            olderCutoff = std::max(olderCutoff, cutoff);
+        }
+
+        auto r = incrementalVacuum(stats);
+        if (!r) {
+            return r.error();
+        }
+        return stats;
+    }
+
+    //walks [from, cutoff) in steps of about m_rowsPerTransaction rows, found through the
+    //timestamp index. steps end on interval bounds, so no point is merged in two transactions.
+    status Compactor::compactTier(const RetentionTier &tier, int64_t from, int64_t cutoff, CompactionStats &stats) {
+        if (from == INT64_MIN) {
+            auto oldest = m_db.query<int64_t>("select min(timestamp) from data where timestamp < ? having count(*) > 0;", cutoff);
+            if (!oldest) {
+                return oldest.error();
+            }
+            if (oldest.value().empty()) {
+                return true;
+            }
+            from = std::get<0>(oldest.value()[0]);
+        }
+
+        int64_t pos = alignDown(from, tier.interval);
+        while (pos < cutoff) {
+            auto next = m_db.query<int64_t>("select timestamp from data where timestamp >= ? and timestamp < ? order by timestamp limit 1 offset ?;",
+                                            pos, cutoff, (int64_t)m_rowsPerTransaction);
+            if (!next) {
+                return next.error();
+            }
+            int64_t end = cutoff;
+            if (!next.value().empty()) {
+                end = std::max(alignDown(std::get<0>(next.value()[0]), tier.interval), pos + tier.interval);
+            }
+
+            auto r = compactRange(tier.interval, pos, end, stats);
+            if (!r) {
+                return r;
+            }
+            r = incrementalVacuum(stats);
+            if (!r) {
+                return r;
+            }
+            pos = end;
+        }
+        return true;
+    }
+
+    //one transaction: the rows of every (sensor, interval) in [from, to) with more than one row
+    //are replaced by a single point. means are weighted by samples, so merged points merge
+    //again correctly and the sums in data_hourly/data_daily still add up.
+    //begin immediate takes the write lock up front: a deferred transaction that reads first
+    //can't wait for the daemon's writer and fails with SQLITE_BUSY instead.
+    status Compactor::compactRange(int64_t interval, int64_t from, int64_t to, CompactionStats &stats) {
+        //both qualified: in the delete below an unqualified timestamp could resolve to compact_points
+        std::string bucket = "data.timestamp - data.timestamp % " + std::to_string(interval);
+        auto r = m_db.execute("begin immediate;");
+        if (!r) {
+            return r;
+        }
+
+        r = m_db.execute("delete from temp.compact_points;");
+        if (r) {
+            auto stmt = m_db.prepareCached("insert into temp.compact_points (sensor_id, bucket, temp, temp_min, temp_max, samples) "
+                                           "select sensor_id, " + bucket + ", sum(temp * samples) / sum(samples), min(coalesce(temp_min, temp)), max(coalesce(temp_max, temp)), sum(samples) "
+                                           "from data where timestamp >= ? and timestamp < ? group by sensor_id, " + bucket + " having count(*) > 1;");
+            r = stmt ? m_db.execute(stmt.value(), from, to) : status(stmt.error());
+        }
+        int64_t removed = 0;
+        if (r) {
+            auto stmt = m_db.prepareCached("delete from data where timestamp >= ? and timestamp < ? and "
+                                           "exists (select 1 from temp.compact_points c where c.sensor_id = data.sensor_id and c.bucket = " + bucket + ");");
+            r = stmt ? m_db.execute(stmt.value(), from, to) : status(stmt.error());
+            removed = sqlite3_changes(m_db.handle());
+        }
+        if (r) {
+            r = m_db.execute("insert into data (timestamp, temp, sensor_id, temp_min, temp_max, samples) "
+                             "select bucket, temp, sensor_id, temp_min, temp_max, samples from temp.compact_points;");
+            removed -= sqlite3_changes(m_db.handle());
+        }
+        if (!r) {
+            m_db.rollback();
+            return r;
+        }
+
+        r = m_db.commit();
+        if (!r) {
+            m_db.rollback();
+            return r;
+        }
+        stats.rowsRemoved += (uint64_t)removed;
+        stats.transactions++;
+        return true;
+    }
+
+    //without auto_vacuum = INCREMENTAL the pragma does nothing and the free pages are reused
+    //by later inserts instead
+    status Compactor::incrementalVacuum(CompactionStats &stats) {
+        for (;;) {
+            auto free = m_db.query<int64_t>("pragma freelist_count;");
+            if (!free) {
+                return free.error();
+            }
+            int64_t before = free.value().empty() ? 0 : std::get<0>(free.value()[0]);
+            if (before == 0) {
+                return true;
+            }
+
+            auto r = m_db.execute("pragma incremental_vacuum(" + std::to_string(kVacuumPages) + ");");
+            if (!r) {
+                return r;
+            }
+
+            free = m_db.query<int64_t>("pragma freelist_count;");
+            if (!free) {
+                return free.error();
+            }
+            int64_t after = free.value().empty() ? 0 : std::get<0>(free.value()[0]);
+            if (after >= before) {
+                return true;
+            }
+            stats.pagesFreed += (uint64_t)(before - after);
+        }
+    }
+
+    Result<bool> Compactor::enableIncrementalVacuum() {
+        auto mode = m_db.query<int64_t>("pragma auto_vacuum;");
+        if (!mode) {
+            return mode.error();
+        }
+        //2 is INCREMENTAL
+        if (!mode.value().empty() && std::get<0>(mode.value()[0]) == 2) {
+            return false;
+        }
+
+        auto r = m_db.execute("pragma auto_vacuum = incremental;");
+        if (r) {
+            r = m_db.execute("vacuum;");
+        }
+        if (!r) {
+            return r.error();
+        }
+        return true;
+    }
+
+#pragma mark - background
+    void Compactor::start(int periodSeconds) {
+        if (m_thread.joinable()) {
+            return;
+        }
+        m_stop = false;
+        m_thread = std::thread(&Compactor::loop, this, periodSeconds);
+    }
+
+    void Compactor::stop() {
+        if (!m_thread.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wakeup.notify_one();
+        m_thread.join();
+    }
+
+    status Compactor::lastError() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        status e = m_error;
+        m_error = true;
+        return e;
+    }
+
+    void Compactor::loop(int periodSeconds) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            lock.unlock();
+            auto r = run(std::time(nullptr));
+            lock.lock();
+            if (!r) {
+                m_error = r.error();
+            }
+
+            m_wakeup.wait_for(lock, std::chrono::seconds(periodSeconds), [this] {
+                return m_stop;
+            });
+        }
+    }
+}
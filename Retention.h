@@ -0,0 +1,92 @@
+#pragma once
+#include "Types.h"
+#include "CelSQL.h"
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//retention: old readings are thinned out into aggregated points (mean, min, max and samples
+//per sensor and interval, like --persist-interval writes them), so the database stops growing
+//with the age of the logger. data_hourly and data_daily stay as they are, and so do the
+//results of findReadings() and findExtreme(), which go by the min and max of a point.
+namespace db {
+    const int kRetentionErrorPolicy = 1;
+
+    //readings older than age are merged into one point per sensor and interval
+    struct RetentionTier {
+        int64_t age;        //seconds
+        int64_t interval;   //seconds
+    };
+
+    //tiers by age. every interval divides an hour and is a longer multiple of the one before, so a
+    //point never leaves its hourly rollup bucket and older tiers only merge further.
+    struct RetentionPolicy {
+        std::vector<RetentionTier> tiers;
+
+        //raw readings for 30 days, 5 minute points for a year, hourly points after that
+        static RetentionPolicy standard();
+
+        //"<age>:<interval>,..." with durations in s, m, h, d or y (e.g. the standard
+        //policy is "30d:5m,365d:1h")
+        static Result<RetentionPolicy> parse(const std::string &spec);
+    };
+
+    struct CompactionStats {
+        uint64_t rowsRemoved;
+        uint64_t transactions;
+        uint64_t pagesFreed;    //returned to the file system by incremental vacuum
+    };
+
+    //applies a RetentionPolicy on its own connection, in transactions of about
+    //rowsPerTransaction rows, so a writer on the same database never waits for long.
+    //freed pages go back to the file system with PRAGMA incremental_vacuum once the database
+    //has auto_vacuum = INCREMENTAL (new databases do, older ones after vacuum()).
+    class Compactor {
+    public:
+        explicit Compactor(const RetentionPolicy &policy, size_t rowsPerTransaction = 10000);
+        ~Compactor();
+
+        Compactor(const Compactor &src) = delete;
+        Compactor &operator=(const Compactor &src) = delete;
+
+        status open(const Path path, const sql::Options &options = sql::Options::writer());
+        void close();
+
+        //compacts everything older than the tiers allow at now
+        Result<CompactionStats> run(std::time_t now);
+
+        //switches the database to auto_vacuum = INCREMENTAL if it isn't yet. that needs a
+        //VACUUM, which rewrites the whole file and blocks writers meanwhile - not for the daemon.
+        //returns whether it did.
+        Result<bool> enableIncrementalVacuum();
+
+        //background compaction: run() every periodSeconds on a thread of its own
+        void start(int periodSeconds);
+        void stop();
+
+        //the last error of the background thread (true if there was none). clears it.
+        status lastError();
+
+    private:
+        status compactTier(const RetentionTier &tier, int64_t from, int64_t cutoff, CompactionStats &stats);
+        status compactRange(int64_t interval, int64_t from, int64_t to, CompactionStats &stats);
+        status incrementalVacuum(CompactionStats &stats);
+        void loop(int periodSeconds);
+
+        RetentionPolicy m_policy;
+        size_t m_rowsPerTransaction;
+        sql::db m_db;
+        //by tier: everything before this is compacted already (by this process)
+        std::vector<int64_t> m_done;
+
+        std::mutex m_mutex;
+        std::condition_variable m_wakeup;
+        bool m_stop;
+        status m_error;
+        std::thread m_thread;
+    };
+}
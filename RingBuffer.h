@@ -0,0 +1,62 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+//fixed size ring buffer. the storage is allocated once up front and the
+//elements live in one contiguous block. when full the oldest element is
+//overwritten. index 0 is always the oldest element.
+template <class T>
+class RingBuffer {
+public:
+    RingBuffer(size_t capacity) : m_data(capacity > 0 ? capacity : 1), m_head(0), m_count(0) {
+    }
+
+    void push(const T &v) {
+        m_data[m_head] = v;
+        m_head++;
+        if (m_head == m_data.size()) {
+            m_head = 0;
+        }
+        if (m_count < m_data.size()) {
+            m_count++;
+        }
+    }
+
+    size_t size() const {
+        return m_count;
+    }
+
+    size_t capacity() const {
+        return m_data.size();
+    }
+
+    bool empty() const {
+        return m_count == 0;
+    }
+
+    void clear() {
+        m_head = 0;
+        m_count = 0;
+    }
+
+    const T &operator[](size_t idx) const {
+        size_t start = m_head + m_data.size() - m_count;
+        size_t pos = start + idx;
+        if (pos >= m_data.size()) {
+            pos -= m_data.size();
+        }
+        if (pos >= m_data.size()) {
+            pos -= m_data.size();
+        }
+        return m_data[pos];
+    }
+
+    const T &back() const {
+        return (*this)[m_count - 1];
+    }
+
+private:
+    std::vector<T> m_data;
+    size_t m_head;
+    size_t m_count;
+};
@@ -0,0 +1,119 @@
+#include "Sampler.h"
+
+namespace sampler {
+    Sampler::Sampler(size_t capacity, int persistInterval) : m_samples(capacity), m_persistInterval(persistInterval), m_total(0) {
+    }
+
+    uint32_t Sampler::sensorIndex(const std::string &sensorID) {
+        for (uint32_t i = 0; i < m_sensorIDs.size(); i++) {
+            if (m_sensorIDs[i] == sensorID) {
+                return i;
+            }
+        }
+
+        m_sensorIDs.push_back(sensorID);
+        Bucket b;
+        b.count = 0;
+        m_buckets.push_back(b);
+        return (uint32_t)(m_sensorIDs.size() - 1);
+    }
+
+    void Sampler::close(uint32_t sensor) {
+        Bucket &b = m_buckets[sensor];
+        if (b.count == 0) {
+            return;
+        }
+
+        db::Point p;
+        p.timestamp = (std::time_t)b.start;
+        p.temp = b.sum / (double)b.count;
+        p.tempMin = b.min;
+        p.tempMax = b.max;
+        p.samples = b.count;
+        m_pending.push_back(std::make_pair(sensor, p));
+
+        b.count = 0;
+    }
+
+    void Sampler::add(const std::string &sensorID, int64_t timestamp, double temp) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint32_t sensor = sensorIndex(sensorID);
+
+        Sample s;
+        s.timestamp = timestamp;
+        s.temp = temp;
+        s.sensor = sensor;
+        m_samples.push(s);
+        m_total++;
+
+        int64_t seconds = timestamp / 1000;
+        if (m_persistInterval <= 0) {
+            db::Point p;
+            p.timestamp = (std::time_t)seconds;
+            p.temp = temp;
+            p.tempMin = temp;
+            p.tempMax = temp;
+            p.samples = 1;
+            m_pending.push_back(std::make_pair(sensor, p));
+            return;
+        }
+
+        int64_t start = seconds - seconds % m_persistInterval;
+        Bucket &b = m_buckets[sensor];
+        if (b.count > 0 && b.start != start) {
+            close(sensor);
+        }
+        if (b.count == 0) {
+            b.start = start;
+            b.sum = 0.0;
+            b.min = temp;
+            b.max = temp;
+        }
+        b.sum += temp;
+        if (temp < b.min) {
+            b.min = temp;
+        }
+        if (temp > b.max) {
+            b.max = temp;
+        }
+        b.count++;
+    }
+
+    void Sampler::persist(db::Writer &writer, int64_t now, bool flushAll) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        int64_t seconds = now / 1000;
+        for (uint32_t i = 0; i < m_buckets.size(); i++) {
+            const Bucket &b = m_buckets[i];
+            if (b.count > 0 && (flushAll || b.start + m_persistInterval <= seconds)) {
+                close(i);
+            }
+        }
+
+        for (const auto &p : m_pending) {
+            writer.add(m_sensorIDs[p.first], p.second);
+        }
+        m_pending.clear();
+    }
+
+    std::vector<Sample> Sampler::recent(int64_t since) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        //samples arrive in time order, so we can bisect for the first one in range
+        size_t lo = 0;
+        size_t hi = m_samples.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (m_samples[mid].timestamp < since) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        std::vector<Sample> res;
+        res.reserve(m_samples.size() - lo);
+        for (size_t i = lo; i < m_samples.size(); i++) {
+            res.push_back(m_samples[i]);
+        }
+        return res;
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "Types.h"
+#include "RingBuffer.h"
+#include "Database.h"
+#include <vector>
+#include <cstdint>
+#include <mutex>
+
+namespace sampler {
+    struct Sample {
+        int64_t timestamp; //milliseconds since the epoch
+        double temp;
+        uint32_t sensor;   //index into Sampler::sensorID()
+    };
+
+    //keeps the most recent raw samples in memory and only hands aggregated
+    //points (min/max/mean per persistInterval seconds) to the database.
+    //with persistInterval == 0 every sample is persisted as is.
+    //thread safe: the RecentServer (see Recent.h) reads it while the daemon adds samples.
+    class Sampler {
+    public:
+        Sampler(size_t capacity, int persistInterval);
+
+        void add(const std::string &sensorID, int64_t timestamp, double temp);
+
+        //queues every point whose interval ended before now (ms) on the writer.
+        //flushAll also queues the intervals that are still open, use it on shutdown.
+        void persist(db::Writer &writer, int64_t now, bool flushAll = false);
+
+        //raw samples not older than since (ms), oldest first
+        std::vector<Sample> recent(int64_t since) const;
+
+        std::string sensorID(uint32_t idx) const {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_sensorIDs[idx];
+        }
+
+        //number of samples added since construction
+        int64_t total() const {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_total;
+        }
+
+    private:
+        struct Bucket {
+            int64_t start;
+            double sum;
+            double min;
+            double max;
+            int64_t count;
+        };
+
+        uint32_t sensorIndex(const std::string &sensorID);
+        void close(uint32_t sensor);
+
+        mutable std::mutex m_mutex;
+        RingBuffer<Sample> m_samples;
+        int m_persistInterval;
+        int64_t m_total;
+
+        std::vector<std::string> m_sensorIDs;
+        std::vector<Bucket> m_buckets;
+        //closed intervals waiting to be handed to the writer
+        std::vector<std::pair<uint32_t, db::Point>> m_pending;
+    };
+}
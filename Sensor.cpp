@@ -1,29 +1,196 @@
 #include "Sensor.h"
 #include <hidapi.h>
+#include <chrono>
+#include <future>
 
 namespace sensor {
-    Result<double> readTemp() {
-        hid_device *handle = hid_open(0x16c0, 0x0480, nullptr);
-        if (!handle) {
-            return jsz::Error(1, __PRETTY_FUNCTION__, "No sensor found!");
+    const unsigned short kVendorID = 0x16c0;
+    const unsigned short kProductID = 0x0480;
+    const size_t kReportSize = 64;
+    //upper bound for stale reports we throw away before waiting for a fresh one
+    const int kMaxDrainedReports = 32;
+
+    Result<std::vector<DeviceInfo>> enumerate() {
+        std::vector<DeviceInfo> devices;
+
+        hid_device_info *list = hid_enumerate(kVendorID, kProductID);
+        for (hid_device_info *cur = list; cur; cur = cur->next) {
+            DeviceInfo info;
+            info.path = cur->path ? cur->path : "";
+            if (cur->serial_number) {
+                //serials are plain ascii
+                for (const wchar_t *c = cur->serial_number; *c; c++) {
+                    info.id += (char)*c;
+                }
+            }
+            if (info.id.empty()) {
+                info.id = info.path;
+            }
+            devices.push_back(info);
+        }
+        hid_free_enumeration(list);
+
+        if (devices.empty()) {
+            return jsz::Error(kSensorErrorNotFound, __PRETTY_FUNCTION__, "No sensor found!");
+        }
+        return devices;
+    }
+
+#pragma mark - sensor
+    Sensor::Sensor() : m_handle(nullptr) {
+    }
+
+    Sensor::Sensor(const DeviceInfo &info) : m_info(info), m_handle(nullptr) {
+    }
+
+    Sensor::~Sensor() {
+        close();
+    }
+
+    status Sensor::open() {
+        if (m_handle) {
+            return true;
+        }
+
+        if (m_info.path.empty()) {
+            m_handle = hid_open(kVendorID, kProductID, nullptr);
+        } else {
+            m_handle = hid_open_path(m_info.path.c_str());
+        }
+        if (!m_handle) {
+            return jsz::Error(kSensorErrorNotFound, __PRETTY_FUNCTION__, "No sensor found!");
+        }
+        return true;
+    }
+
+    void Sensor::close() {
+        if (m_handle) {
+            hid_close(m_handle);
+            m_handle = nullptr;
+        }
+    }
+
+    //the device keeps sending reports whether we read them or not. everything that
+    //is queued up since the last reading is old, so we throw it away.
+    void Sensor::drain() {
+        unsigned char buf[kReportSize + 1];
+        for (int i = 0; i < kMaxDrainedReports; i++) {
+            int num = hid_read_timeout(m_handle, buf, kReportSize, 0);
+            if (num <= 0) {
+                break;
+            }
         }
+    }
+
+    Result<double> Sensor::readTemp(int timeoutMs) {
+        typedef std::chrono::steady_clock clock;
+        auto deadline = clock::now() + std::chrono::milliseconds(timeoutMs);
+        bool reopened = false;
+
+        auto r = open();
+        if (!r) {
+            return r.error();
+        }
+        drain();
+
+        unsigned char buf[kReportSize + 1];
+        for (;;) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count();
+            if (remaining <= 0) {
+                return jsz::Error(kSensorErrorTimeout, __PRETTY_FUNCTION__, "Sensor did not answer in time!");
+            }
+
+            int num = hid_read_timeout(m_handle, buf, kReportSize, (int)remaining);
+            if (num < 0) {
+                //most likely the device was unplugged. try to get a new handle once.
+                close();
+                if (reopened) {
+                    return jsz::Error(kSensorErrorRead, __PRETTY_FUNCTION__, "Could not read from sensor!");
+                }
+                reopened = true;
+                r = open();
+                if (!r) {
+                    return r.error();
+                }
+                continue;
+            }
 
-        unsigned char buf[65];
-	int num = 0;
+            if (num == (int)kReportSize) {
+                short temp = *(short *) &buf[4]; //holy fuck!
+                return double(temp);
+            }
 
-	//we perform the read 3 times as the sensor sometimes won't wake up on the first try.
-	for (int i = 0; i < 3; i++) {
-	        num = hid_read(handle, buf, 64);
-       		if (num < 0) {
-       	     		return jsz::Error(2, __PRETTY_FUNCTION__, "Could not read from sensor!");
-       	 	}
-	}
+            //0 means the read timed out, anything else is a short report we don't understand
+            if (num > 0) {
+                return jsz::Error(kSensorErrorUnexpectedData, __PRETTY_FUNCTION__, "Sensor returned unexpected data!");
+            }
+        }
+    }
+
+#pragma mark - sensor set
+    status SensorSet::rescan() {
+        auto devices = enumerate();
+        if (!devices) {
+            return devices.error();
+        }
 
-        if (num == 64) {
-            short temp = *(short *) &buf[4]; //holy fuck!
-            return double(temp);
+        for (const auto &info : devices.value()) {
+            bool known = false;
+            for (const auto &s : m_sensors) {
+                if (s->id() == info.id) {
+                    known = true;
+                    break;
+                }
+            }
+            if (!known) {
+                m_sensors.push_back(std::unique_ptr<Sensor>(new Sensor(info)));
+            }
         }
+        return true;
+    }
 
-        return jsz::Error(3, __PRETTY_FUNCTION__, "Sensor returned unexpected data!");
+    //the probe reports 1/10 degrees
+    static Reading makeReading(const Sensor &sensor, int64_t timestamp, const Result<double> &raw) {
+        Reading r;
+        r.sensorID = sensor.id();
+        r.timestamp = timestamp;
+        if (raw) {
+            r.temp = raw.value() / 10.0;
+        } else {
+            r.temp = raw.error();
+        }
+        return r;
+    }
+
+    std::vector<Reading> SensorSet::poll() {
+        std::vector<Reading> readings;
+        readings.reserve(m_sensors.size());
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        //no need to spin up threads for the common single probe setup
+        if (m_sensors.size() == 1) {
+            readings.push_back(makeReading(*m_sensors[0], now, m_sensors[0]->readTemp(m_timeoutMs)));
+            return readings;
+        }
+
+        int timeoutMs = m_timeoutMs;
+        std::vector<std::future<Result<double>>> pending;
+        pending.reserve(m_sensors.size());
+        for (auto &s : m_sensors) {
+            Sensor *sensor = s.get();
+            pending.push_back(std::async(std::launch::async, [sensor, timeoutMs]() {
+                return sensor->readTemp(timeoutMs);
+            }));
+        }
+
+        for (size_t i = 0; i < m_sensors.size(); i++) {
+            readings.push_back(makeReading(*m_sensors[i], now, pending[i].get()));
+        }
+        return readings;
+    }
+
+    Result<double> readTemp() {
+        Sensor s;
+        return s.readTemp();
     }
 }
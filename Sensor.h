@@ -1,7 +1,142 @@
 #pragma once
 #include "Types.h"
+#include "CelSQL.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+struct hid_device_;
 
 namespace sensor {
+    const int kSensorErrorNotFound = 1;
+    const int kSensorErrorRead = 2;
+    const int kSensorErrorUnexpectedData = 3;
+    const int kSensorErrorTimeout = 4;
+    const int kSensorErrorReplay = 5;
+
+    struct Reading {
+        std::string sensorID;
+        int64_t timestamp; //milliseconds since the epoch
+        Result<double> temp; //degrees celsius
+    };
+
+    //something that produces temperature readings. the daemon polls it once per tick.
+    class Source {
+    public:
+        virtual ~Source() {}
+
+        //(re)discovers the sensors. called before the first poll and after a poll had failed readings.
+        virtual status rescan() = 0;
+
+        //everything that was measured since the last poll
+        virtual std::vector<Reading> poll() = 0;
+
+        //finite sources (replay) return true once there is nothing left to read
+        virtual bool exhausted() const {
+            return false;
+        }
+    };
+
+//hidapi driver for the DS18B20 usb probes
+    struct DeviceInfo {
+        std::string path;
+        //serial number of the probe, falls back to the device path if it has none
+        std::string id;
+    };
+
+    //lists all attached probes
+    Result<std::vector<DeviceInfo>> enumerate();
+
+    //keeps the HID handle open for its whole lifetime so a long running
+    //process doesn't have to enumerate USB again for every reading.
+    //if the device goes away (unplugged, usb reset) the next read reopens it.
+    class Sensor {
+    public:
+        //opens the first probe found
+        Sensor();
+        //opens the probe at the given hidapi path
+        Sensor(const DeviceInfo &info);
+        ~Sensor();
+
+        Sensor(const Sensor &src) = delete;
+        Sensor &operator=(const Sensor &src) = delete;
+
+        status open();
+        void close();
+
+        const std::string &id() const {
+            return m_info.id;
+        }
+
+        //returns the temperature in 1/10 degrees. waits at most timeoutMs for a fresh report.
+        Result<double> readTemp(int timeoutMs = 2000);
+
+    private:
+        void drain();
+
+        DeviceInfo m_info;
+        hid_device_ *m_handle;
+    };
+
+    //all probes attached to this host. reads them concurrently so a slow or
+    //hanging probe doesn't delay the others.
+    class SensorSet : public Source {
+    public:
+        SensorSet(int timeoutMs = 2000) : m_timeoutMs(timeoutMs) {
+        }
+
+        //enumerates the attached probes and adds those we don't know yet
+        status rescan() override;
+
+        std::vector<Reading> poll() override;
+
+        size_t size() const {
+            return m_sensors.size();
+        }
+
+    private:
+        std::vector<std::unique_ptr<Sensor>> m_sensors;
+        int m_timeoutMs;
+    };
+
+    //one shot convenience: opens the sensor, reads once and closes it again
     Result<double> readTemp();
-}
 
+//drivers for testing without hardware
+    //generates sensorCount virtual sensors that each produce rate readings per second.
+    //used to load test ingestion and storage without a probe attached.
+    class SimulatedSource : public Source {
+    public:
+        SimulatedSource(int sensorCount, double rate);
+
+        status rescan() override;
+        std::vector<Reading> poll() override;
+
+    private:
+        std::vector<std::string> m_ids;
+        double m_rate;
+        int64_t m_last;
+        double m_carry;
+        uint64_t m_rng;
+    };
+
+    //streams the rows of an existing temp.db, batchSize readings per poll.
+    //timestamps are the historical ones from the database.
+    class ReplaySource : public Source {
+    public:
+        ReplaySource(const Path &path, size_t batchSize);
+
+        status rescan() override;
+        std::vector<Reading> poll() override;
+        bool exhausted() const override {
+            return m_done;
+        }
+
+    private:
+        sql::db m_db;
+        std::unique_ptr<sql::Cursor> m_rows;
+        Path m_path;
+        size_t m_batchSize;
+        bool m_done;
+    };
+}
@@ -0,0 +1,58 @@
+#include "Sensor.h"
+
+namespace sensor {
+    ReplaySource::ReplaySource(const Path &path, size_t batchSize) : m_path(path), m_batchSize(batchSize > 0 ? batchSize : 1), m_done(false) {
+    }
+
+    status ReplaySource::rescan() {
+        if (m_rows) {
+            return true;
+        }
+
+        auto res = m_db.initWithPath(m_path, false, sql::Options::reader());
+        if (!res) {
+            return res.error();
+        }
+
+        auto cur = m_db.cursor("select d.timestamp, d.temp, coalesce(s.serial, 'sensor-' || d.sensor_id) from data d left join sensors s on s.id = d.sensor_id order by d.id;");
+        if (!cur) {
+            //databases from before multi sensor support
+            cur = m_db.cursor("select timestamp, temp, 'sensor-0' from data order by id;");
+            if (!cur) {
+                return cur.error();
+            }
+        }
+        m_rows.reset(new sql::Cursor(std::move(cur.value())));
+
+        return true;
+    }
+
+    std::vector<Reading> ReplaySource::poll() {
+        std::vector<Reading> readings;
+        if (m_done || !m_rows) {
+            return readings;
+        }
+
+        readings.reserve(m_batchSize);
+        while (readings.size() < m_batchSize) {
+            auto row = m_rows->next();
+            if (!row || !row.value()) {
+                m_done = true;
+                if (!row) {
+                    Reading r;
+                    r.timestamp = 0;
+                    r.temp = row.error();
+                    readings.push_back(r);
+                }
+                break;
+            }
+
+            Reading r;
+            r.timestamp = m_rows->getInteger(0).value_or(0) * 1000;
+            r.temp = m_rows->getDouble(1);
+            r.sensorID = m_rows->getTextView(2).value_or(sql::TextView()).str();
+            readings.push_back(r);
+        }
+        return readings;
+    }
+}
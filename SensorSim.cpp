@@ -0,0 +1,53 @@
+#include "Sensor.h"
+#include <chrono>
+#include <cmath>
+
+namespace sensor {
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    SimulatedSource::SimulatedSource(int sensorCount, double rate) : m_rate(rate), m_last(nowMs()), m_carry(0.0), m_rng(0x9e3779b97f4a7c15ULL) {
+        for (int i = 0; i < sensorCount; i++) {
+            m_ids.push_back("sim-" + std::to_string(i));
+        }
+    }
+
+    status SimulatedSource::rescan() {
+        return true;
+    }
+
+    //a slow daily sine wave plus some noise, so compression and aggregation see realistic data
+    std::vector<Reading> SimulatedSource::poll() {
+        int64_t now = nowMs();
+        int64_t elapsed = now - m_last;
+
+        double wanted = (double)elapsed / 1000.0 * m_rate + m_carry;
+        size_t count = (size_t)wanted;
+        m_carry = wanted - (double)count;
+
+        std::vector<Reading> readings;
+        readings.reserve(count * m_ids.size());
+        for (size_t i = 0; i < count; i++) {
+            int64_t ts = m_last + (int64_t)((double)elapsed * (double)(i + 1) / (double)count);
+            double base = 20.0 + 5.0 * sin(2.0 * M_PI * (double)(ts % 86400000) / 86400000.0);
+
+            for (size_t s = 0; s < m_ids.size(); s++) {
+                //xorshift64
+                m_rng ^= m_rng << 13;
+                m_rng ^= m_rng >> 7;
+                m_rng ^= m_rng << 17;
+                double noise = (double)(m_rng % 1000) / 2000.0 - 0.25;
+
+                Reading r;
+                r.sensorID = m_ids[s];
+                r.timestamp = ts;
+                r.temp = base + (double)s * 0.1 + noise;
+                readings.push_back(r);
+            }
+        }
+
+        m_last = now;
+        return readings;
+    }
+}
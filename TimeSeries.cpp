@@ -0,0 +1,743 @@
+#include "TimeSeries.h"
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+namespace db {
+    static const char kFileMagic[8] = {'T', 'E', 'M', 'P', 'T', 'S', 'D', 'B'};
+    static const uint32_t kPayloadBits = (uint32_t)(kTimeSeriesBlockSize - sizeof(BlockHeader)) * 8;
+    //worst case of one sample: 4 + 64 bits timestamp, 3 + 5 + 6 + 64 bits temperature
+    static const uint32_t kMaxSampleBits = 146;
+
+    static uint64_t doubleBits(double d) {
+        uint64_t u;
+        memcpy(&u, &d, sizeof(u));
+        return u;
+    }
+
+    static double bitsDouble(uint64_t u) {
+        double d;
+        memcpy(&d, &u, sizeof(d));
+        return d;
+    }
+
+    //probes report steps of 0.1 or 0.0625 degrees. values that are exactly n / 100 are
+    //stored as the change in hundredths, far fewer bits than XORing their doubles.
+    static bool hundredths(double d, int64_t &n) {
+        if (!(d > -1e12 && d < 1e12)) {
+            return false;
+        }
+        n = llround(d * 100.0);
+        return doubleBits((double)n / 100.0) == doubleBits(d);
+    }
+
+    //comparisons with NaN are false, so NaN never widens the zone
+    static void widenZone(double temp, double &minTemp, double &maxTemp) {
+        if (temp < minTemp) {
+            minTemp = temp;
+        }
+        if (temp > maxTemp) {
+            maxTemp = temp;
+        }
+    }
+
+#pragma mark - encoder
+    class BlockEncoder {
+    public:
+        BlockEncoder(uint32_t sensor) : m_block(kTimeSeriesBlockSize, 0), m_bits(0), m_count(0), m_timestamp(0), m_delta(0), m_value(0), m_leading(-1), m_trailing(0) {
+            BlockHeader *h = header();
+            h->magic = kBlockMagic;
+            h->kind = kBlockData;
+            h->sensor = sensor;
+            h->minTemp = INFINITY;
+            h->maxTemp = -INFINITY;
+        }
+
+        //false if the block is full
+        bool append(int64_t timestamp, double temp) {
+            if (m_count == UINT16_MAX || m_bits + kMaxSampleBits > kPayloadBits) {
+                return false;
+            }
+
+            uint64_t value = doubleBits(temp);
+            if (m_count == 0) {
+                header()->firstTimestamp = timestamp;
+                writeBits(value, 64);
+            } else {
+                writeTimestamp(timestamp);
+                writeValue(value);
+            }
+            m_timestamp = timestamp;
+            m_value = value;
+            m_count++;
+
+            BlockHeader *h = header();
+            h->count = m_count;
+            h->bits = m_bits;
+            h->lastTimestamp = timestamp;
+            widenZone(temp, h->minTemp, h->maxTemp);
+            return true;
+        }
+
+        const uint8_t *data() const {
+            return m_block.data();
+        }
+
+    private:
+        BlockHeader *header() {
+            return (BlockHeader *)m_block.data();
+        }
+
+        void writeBits(uint64_t value, int count) {
+            uint8_t *payload = m_block.data() + sizeof(BlockHeader);
+            while (count > 0) {
+                int free = 8 - (int)(m_bits % 8);
+                int take = count < free ? count : free;
+                uint64_t chunk = (value >> (count - take)) & ((1u << take) - 1);
+                payload[m_bits / 8] |= (uint8_t)(chunk << (free - take));
+                m_bits += (uint32_t)take;
+                count -= take;
+            }
+        }
+
+        void writeTimestamp(int64_t timestamp) {
+            int64_t delta = timestamp - m_timestamp;
+            int64_t dod = delta - m_delta;
+            m_delta = delta;
+
+            if (dod == 0) {
+                writeBits(0, 1);
+            } else if (dod >= -63 && dod <= 64) {
+                writeBits(0x2, 2);
+                writeBits((uint64_t)(dod + 63), 7);
+            } else if (dod >= -255 && dod <= 256) {
+                writeBits(0x6, 3);
+                writeBits((uint64_t)(dod + 255), 9);
+            } else if (dod >= -2047 && dod <= 2048) {
+                writeBits(0xe, 4);
+                writeBits((uint64_t)(dod + 2047), 12);
+            } else {
+                writeBits(0xf, 4);
+                writeBits((uint64_t)dod, 64);
+            }
+        }
+
+        void writeValue(uint64_t value) {
+            uint64_t x = value ^ m_value;
+            if (x == 0) {
+                writeBits(0, 1);
+                return;
+            }
+
+            int64_t prev, cur;
+            if (hundredths(bitsDouble(m_value), prev) && hundredths(bitsDouble(value), cur) && cur - prev >= -63 && cur - prev <= 64) {
+                writeBits(0x2, 2);
+                writeBits((uint64_t)(cur - prev + 63), 7);
+                return;
+            }
+
+            int leading = __builtin_clzll(x);
+            int trailing = __builtin_ctzll(x);
+            if (leading > 31) {
+                leading = 31;
+            }
+
+            //fits into the window of the last value: only the meaningful bits
+            if (m_leading >= 0 && leading >= m_leading && trailing >= m_trailing) {
+                writeBits(0x6, 3);
+                writeBits(x >> m_trailing, 64 - m_leading - m_trailing);
+                return;
+            }
+
+            int meaningful = 64 - leading - trailing;
+            writeBits(0x7, 3);
+            writeBits((uint64_t)leading, 5);
+            writeBits((uint64_t)(meaningful & 63), 6); //64 is stored as 0
+            writeBits(x >> trailing, meaningful);
+            m_leading = leading;
+            m_trailing = trailing;
+        }
+
+        std::vector<uint8_t> m_block;
+        uint32_t m_bits;
+        uint16_t m_count;
+        int64_t m_timestamp;
+        int64_t m_delta;
+        uint64_t m_value;
+        int m_leading;
+        int m_trailing;
+    };
+
+#pragma mark - decoder
+    BlockDecoder::BlockDecoder(const uint8_t *block) : m_payload(block + sizeof(BlockHeader)),
+                                                       m_header((const BlockHeader *)block),
+                                                       m_pos(0),
+                                                       m_index(0),
+                                                       m_timestamp(0),
+                                                       m_delta(0),
+                                                       m_value(0),
+                                                       m_leading(0),
+                                                       m_trailing(0) {
+    }
+
+    uint64_t BlockDecoder::readBits(int count) {
+        uint64_t value = 0;
+        while (count > 0) {
+            int avail = 8 - (int)(m_pos % 8);
+            int take = count < avail ? count : avail;
+            uint64_t chunk = (m_payload[m_pos / 8] >> (avail - take)) & ((1u << take) - 1);
+            value = (value << take) | chunk;
+            m_pos += (uint32_t)take;
+            count -= take;
+        }
+        return value;
+    }
+
+    bool BlockDecoder::next(int64_t &timestamp, double &temp) {
+        if (m_header->kind != kBlockData || m_index >= m_header->count) {
+            return false;
+        }
+
+        if (m_index == 0) {
+            m_timestamp = m_header->firstTimestamp;
+            m_value = readBits(64);
+        } else {
+            int64_t dod;
+            if (readBits(1) == 0) {
+                dod = 0;
+            } else if (readBits(1) == 0) {
+                dod = (int64_t)readBits(7) - 63;
+            } else if (readBits(1) == 0) {
+                dod = (int64_t)readBits(9) - 255;
+            } else if (readBits(1) == 0) {
+                dod = (int64_t)readBits(12) - 2047;
+            } else {
+                dod = (int64_t)readBits(64);
+            }
+            m_delta += dod;
+            m_timestamp += m_delta;
+
+            if (readBits(1) == 1) {
+                if (readBits(1) == 0) {
+                    int64_t prev = llround(bitsDouble(m_value) * 100.0);
+                    m_value = doubleBits((double)(prev + (int64_t)readBits(7) - 63) / 100.0);
+                } else {
+                    if (readBits(1) == 1) {
+                        m_leading = (int)readBits(5);
+                        int meaningful = (int)readBits(6);
+                        if (meaningful == 0) {
+                            meaningful = 64;
+                        }
+                        m_trailing = 64 - m_leading - meaningful;
+                    }
+                    m_value ^= readBits(64 - m_leading - m_trailing) << m_trailing;
+                }
+            }
+        }
+
+        m_index++;
+        timestamp = m_timestamp;
+        temp = bitsDouble(m_value);
+        return true;
+    }
+
+    //the zone map of a block without one (version 1)
+    static void computeZone(const uint8_t *block, double &minTemp, double &maxTemp) {
+        minTemp = INFINITY;
+        maxTemp = -INFINITY;
+        BlockDecoder decoder(block);
+        int64_t timestamp;
+        double temp;
+        while (decoder.next(timestamp, temp)) {
+            widenZone(temp, minTemp, maxTemp);
+        }
+    }
+
+#pragma mark - store
+    TimeSeriesStore::TimeSeriesStore() : m_fd(-1), m_blockCount(0), m_flags(0) {
+    }
+
+    TimeSeriesStore::~TimeSeriesStore() {
+        close();
+    }
+
+    status TimeSeriesStore::open(const Path path) {
+        m_path = path;
+        m_fd = ::open(path.to_string().c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_fd < 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't open " + path.to_string() + ": " + strerror(errno));
+        }
+
+        auto r = load();
+        if (!r) {
+            close();
+            return r;
+        }
+        return true;
+    }
+
+    void TimeSeriesStore::close() {
+        m_open.clear();
+        m_sensorIDs.clear();
+        m_blockCount = 0;
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    //the payload goes out before the header, so a reader that maps the file never sees a
+    //sample count ahead of the bits
+    status TimeSeriesStore::writeBlock(uint64_t index, const uint8_t *block) {
+        off_t offset = (off_t)(index * kTimeSeriesBlockSize);
+        size_t payload = kTimeSeriesBlockSize - sizeof(BlockHeader);
+        if (pwrite(m_fd, block + sizeof(BlockHeader), payload, offset + (off_t)sizeof(BlockHeader)) != (ssize_t)payload ||
+            pwrite(m_fd, block, sizeof(BlockHeader), offset) != (ssize_t)sizeof(BlockHeader)) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't write block " + std::to_string(index) + " of " + m_path.to_string() + ": " + strerror(errno));
+        }
+        return true;
+    }
+
+    status TimeSeriesStore::writeFlags() {
+        if (pwrite(m_fd, &m_flags, sizeof(m_flags), (off_t)offsetof(FileHeader, flags)) != (ssize_t)sizeof(m_flags)) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't write the header of " + m_path.to_string() + ": " + strerror(errno));
+        }
+        return true;
+    }
+
+    //reads the sensor names and picks up the newest data block of every sensor again
+    status TimeSeriesStore::load() {
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't stat " + m_path.to_string());
+        }
+
+        if (st.st_size == 0) {
+            std::vector<uint8_t> block(kTimeSeriesBlockSize, 0);
+            FileHeader *fh = (FileHeader *)block.data();
+            memcpy(fh->magic, kFileMagic, sizeof(kFileMagic));
+            fh->version = kTimeSeriesVersion;
+            fh->blockSize = (uint32_t)kTimeSeriesBlockSize;
+            m_blockCount = 1;
+            m_flags = 0;
+            return writeBlock(0, block.data());
+        }
+
+        FileHeader fh;
+        if (pread(m_fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh) || memcmp(fh.magic, kFileMagic, sizeof(kFileMagic)) != 0) {
+            return jsz::Error(kTimeSeriesErrorFormat, __PRETTY_FUNCTION__, m_path.to_string() + " is not a time series file");
+        }
+        if (fh.version < 1 || fh.version > kTimeSeriesVersion || fh.blockSize != kTimeSeriesBlockSize) {
+            return jsz::Error(kTimeSeriesErrorFormat, __PRETTY_FUNCTION__, "Unsupported version " + std::to_string(fh.version) + " of " + m_path.to_string());
+        }
+        m_flags = fh.flags;
+        //the zone maps of version 1 files are filled in below, the version goes up once they are all on disk
+        bool upgrade = fh.version < kTimeSeriesVersion;
+
+        //a torn last block from a crash is dropped
+        m_blockCount = (uint64_t)st.st_size / kTimeSeriesBlockSize;
+
+        std::map<uint32_t, uint64_t> newest;
+        std::vector<uint8_t> block(kTimeSeriesBlockSize);
+        for (uint64_t i = 1; i < m_blockCount; i++) {
+            if (pread(m_fd, block.data(), kTimeSeriesBlockSize, (off_t)(i * kTimeSeriesBlockSize)) != (ssize_t)kTimeSeriesBlockSize) {
+                return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't read block " + std::to_string(i) + " of " + m_path.to_string());
+            }
+            const BlockHeader *h = (const BlockHeader *)block.data();
+            if (h->magic != kBlockMagic) {
+                continue;
+            }
+            if (h->kind == kBlockSensor) {
+                size_t length = std::min<size_t>(h->bits / 8, kTimeSeriesBlockSize - sizeof(BlockHeader));
+                m_sensorIDs[std::string((const char *)block.data() + sizeof(BlockHeader), length)] = h->sensor;
+            } else if (h->kind == kBlockData) {
+                newest[h->sensor] = i;
+                if (upgrade) {
+                    BlockHeader zoned = *h;
+                    computeZone(block.data(), zoned.minTemp, zoned.maxTemp);
+                    if (pwrite(m_fd, &zoned, sizeof(zoned), (off_t)(i * kTimeSeriesBlockSize)) != (ssize_t)sizeof(zoned)) {
+                        return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't write block " + std::to_string(i) + " of " + m_path.to_string() + ": " + strerror(errno));
+                    }
+                }
+            }
+        }
+
+        if (upgrade) {
+            fh.version = kTimeSeriesVersion;
+            if (fsync(m_fd) != 0 || pwrite(m_fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh) || fsync(m_fd) != 0) {
+                return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't upgrade " + m_path.to_string() + ": " + strerror(errno));
+            }
+        }
+
+        //continue the newest blocks: replay their samples into a fresh encoder at the same place
+        for (const auto &e : newest) {
+            if (pread(m_fd, block.data(), kTimeSeriesBlockSize, (off_t)(e.second * kTimeSeriesBlockSize)) != (ssize_t)kTimeSeriesBlockSize) {
+                return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't read block " + std::to_string(e.second) + " of " + m_path.to_string());
+            }
+            const BlockHeader *h = (const BlockHeader *)block.data();
+            if (h->bits + kMaxSampleBits > kPayloadBits || h->count == UINT16_MAX) {
+                continue;
+            }
+
+            OpenBlock open;
+            open.index = e.second;
+            open.encoder.reset(new BlockEncoder(e.first));
+            BlockDecoder decoder(block.data());
+            int64_t timestamp;
+            double temp;
+            while (decoder.next(timestamp, temp)) {
+                open.encoder->append(timestamp, temp);
+            }
+            m_open[e.first] = std::move(open);
+        }
+        return true;
+    }
+
+    Result<uint32_t> TimeSeriesStore::sensorID(const std::string &serial) {
+        auto it = m_sensorIDs.find(serial);
+        if (it != m_sensorIDs.end()) {
+            return it->second;
+        }
+
+        uint32_t id = (uint32_t)m_sensorIDs.size();
+        std::vector<uint8_t> block(kTimeSeriesBlockSize, 0);
+        BlockHeader *h = (BlockHeader *)block.data();
+        h->magic = kBlockMagic;
+        h->kind = kBlockSensor;
+        h->sensor = id;
+        size_t length = std::min(serial.size(), kTimeSeriesBlockSize - sizeof(BlockHeader));
+        h->bits = (uint32_t)(length * 8);
+        memcpy(block.data() + sizeof(BlockHeader), serial.data(), length);
+
+        auto r = writeBlock(m_blockCount, block.data());
+        if (!r) {
+            return r.error();
+        }
+        m_blockCount++;
+        m_sensorIDs[serial] = id;
+        return id;
+    }
+
+    status TimeSeriesStore::addPoints(const Batch &points) {
+        if (m_fd < 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Not open");
+        }
+
+        //the open blocks are rewritten in place, keep them as they are on disk now
+        uint64_t blockCount = m_blockCount;
+        std::map<uint64_t, std::vector<uint8_t>> saved;
+        for (const auto &e : m_open) {
+            const uint8_t *data = e.second.encoder->data();
+            saved[e.second.index].assign(data, data + kTimeSeriesBlockSize);
+        }
+
+        auto r = write(points);
+        if (!r && !rollback(blockCount, saved)) {
+            //the file is in an unknown state now, nothing more goes into it
+            close();
+        }
+        return r;
+    }
+
+    //all or none: the file goes back to where it was before the batch, so a retry doesn't
+    //store points twice
+    status TimeSeriesStore::rollback(uint64_t blockCount, const std::map<uint64_t, std::vector<uint8_t>> &saved) {
+        if (ftruncate(m_fd, (off_t)(blockCount * kTimeSeriesBlockSize)) != 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't truncate " + m_path.to_string() + ": " + strerror(errno));
+        }
+        for (const auto &e : saved) {
+            auto r = writeBlock(e.first, e.second.data());
+            if (!r) {
+                return r;
+            }
+        }
+        if (fsync(m_fd) != 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't sync " + m_path.to_string() + ": " + strerror(errno));
+        }
+
+        m_open.clear();
+        m_sensorIDs.clear();
+        return load();
+    }
+
+    status TimeSeriesStore::write(const Batch &points) {
+        std::set<uint32_t> dirty;
+        for (const auto &p : points) {
+            auto sid = sensorID(p.first);
+            if (!sid) {
+                return sid.error();
+            }
+
+            auto it = m_open.find(sid.value());
+            if (it == m_open.end() || !it->second.encoder->append(p.second.timestamp, p.second.temp)) {
+                if (it != m_open.end()) {
+                    //full: its last state goes out now, the sensor continues in a new block
+                    auto r = writeBlock(it->second.index, it->second.encoder->data());
+                    if (!r) {
+                        return r;
+                    }
+                }
+                OpenBlock open;
+                open.index = m_blockCount++;
+                open.encoder.reset(new BlockEncoder(sid.value()));
+                open.encoder->append(p.second.timestamp, p.second.temp);
+                m_open[sid.value()] = std::move(open);
+            }
+            dirty.insert(sid.value());
+        }
+
+        for (uint32_t sid : dirty) {
+            const OpenBlock &open = m_open[sid];
+            auto r = writeBlock(open.index, open.encoder->data());
+            if (!r) {
+                return r;
+            }
+        }
+
+        //the first aggregated point marks the file, the reader can't tell otherwise
+        if (!(m_flags & kFileAggregated)) {
+            for (const auto &p : points) {
+                if (p.second.samples > 1) {
+                    m_flags |= kFileAggregated;
+                    auto r = writeFlags();
+                    if (!r) {
+                        return r;
+                    }
+                    break;
+                }
+            }
+        }
+
+#ifdef __linux__
+        int err = fdatasync(m_fd);
+#else
+        int err = fsync(m_fd);
+#endif
+        if (err != 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't sync " + m_path.to_string() + ": " + strerror(errno));
+        }
+        return true;
+    }
+
+#pragma mark - reader
+    TimeSeriesReader::TimeSeriesReader() : m_fd(-1), m_data(nullptr), m_size(0), m_flags(0) {
+    }
+
+    TimeSeriesReader::~TimeSeriesReader() {
+        close();
+    }
+
+    status TimeSeriesReader::open(const Path path) {
+        m_path = path;
+        m_fd = ::open(path.to_string().c_str(), O_RDONLY);
+        if (m_fd < 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't open " + path.to_string() + ": " + strerror(errno));
+        }
+        auto r = map();
+        if (!r) {
+            close();
+        }
+        return r;
+    }
+
+    void TimeSeriesReader::close() {
+        unmap();
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    void TimeSeriesReader::unmap() {
+        if (m_data) {
+            munmap((void *)m_data, m_size);
+            m_data = nullptr;
+            m_size = 0;
+        }
+        m_sensors.clear();
+        m_blocks.clear();
+    }
+
+    status TimeSeriesReader::refresh() {
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't stat " + m_path.to_string());
+        }
+        if ((size_t)st.st_size / kTimeSeriesBlockSize * kTimeSeriesBlockSize == m_size) {
+            return true;
+        }
+        unmap();
+        return map();
+    }
+
+    //maps the whole blocks of the file and indexes them. only the block headers are touched.
+    status TimeSeriesReader::map() {
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't stat " + m_path.to_string());
+        }
+        size_t size = (size_t)st.st_size / kTimeSeriesBlockSize * kTimeSeriesBlockSize;
+        if (size == 0) {
+            return jsz::Error(kTimeSeriesErrorFormat, __PRETTY_FUNCTION__, m_path.to_string() + " is not a time series file");
+        }
+
+        void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (data == MAP_FAILED) {
+            return jsz::Error(kTimeSeriesErrorIO, __PRETTY_FUNCTION__, "Couldn't map " + m_path.to_string() + ": " + strerror(errno));
+        }
+        m_data = (const uint8_t *)data;
+        m_size = size;
+
+        const FileHeader *fh = (const FileHeader *)m_data;
+        if (memcmp(fh->magic, kFileMagic, sizeof(kFileMagic)) != 0 || fh->version < 1 || fh->version > kTimeSeriesVersion || fh->blockSize != kTimeSeriesBlockSize) {
+            unmap();
+            return jsz::Error(kTimeSeriesErrorFormat, __PRETTY_FUNCTION__, m_path.to_string() + " is not a supported time series file");
+        }
+        m_flags = fh->flags;
+
+        uint64_t count = m_size / kTimeSeriesBlockSize;
+        for (uint64_t i = 1; i < count; i++) {
+            const BlockHeader *h = (const BlockHeader *)block(i);
+            if (h->magic != kBlockMagic) {
+                continue;
+            }
+            if (h->sensor >= m_blocks.size()) {
+                m_blocks.resize(h->sensor + 1);
+                m_sensors.resize(h->sensor + 1);
+            }
+            if (h->kind == kBlockSensor) {
+                size_t length = std::min<size_t>(h->bits / 8, kTimeSeriesBlockSize - sizeof(BlockHeader));
+                m_sensors[h->sensor] = std::string((const char *)block(i) + sizeof(BlockHeader), length);
+            } else if (h->kind == kBlockData && h->count > 0) {
+                auto &blocks = m_blocks[h->sensor];
+                BlockRef ref;
+                ref.firstTimestamp = h->firstTimestamp;
+                ref.lastTimestamp = h->lastTimestamp;
+                ref.maxLastTimestamp = blocks.empty() ? h->lastTimestamp : std::max(blocks.back().maxLastTimestamp, h->lastTimestamp);
+                if (fh->version < 2) {
+                    computeZone(block(i), ref.minTemp, ref.maxTemp);
+                } else {
+                    ref.minTemp = h->minTemp;
+                    ref.maxTemp = h->maxTemp;
+                }
+                ref.index = i;
+                blocks.push_back(ref);
+            }
+        }
+        return true;
+    }
+
+    TimeSeriesReader::Range TimeSeriesReader::range(uint32_t sensor, int64_t from, int64_t to) const {
+        return range(sensor, from, to, false, 0.0, 0.0);
+    }
+
+    TimeSeriesReader::Range TimeSeriesReader::range(uint32_t sensor, int64_t from, int64_t to, double minTemp, double maxTemp) const {
+        return range(sensor, from, to, true, minTemp, maxTemp);
+    }
+
+    TimeSeriesReader::Range TimeSeriesReader::range(uint32_t sensor, int64_t from, int64_t to, bool filtered, double minTemp, double maxTemp) const {
+        static const std::vector<BlockRef> none;
+        const std::vector<BlockRef> *blocks = sensor < m_blocks.size() ? &m_blocks[sensor] : &none;
+
+        //the first block that can hold samples at or after from
+        auto first = std::lower_bound(blocks->begin(), blocks->end(), from, [](const BlockRef &ref, int64_t t) {
+            return ref.maxLastTimestamp < t;
+        });
+        Range r(this, blocks, (size_t)(first - blocks->begin()), from, to);
+        r.m_filtered = filtered;
+        r.m_minTemp = minTemp;
+        r.m_maxTemp = maxTemp;
+        return r;
+    }
+
+    bool TimeSeriesReader::extreme(uint32_t sensor, int64_t from, int64_t to, bool warmest, int64_t &timestamp, double &temp) const {
+        if (sensor >= m_blocks.size()) {
+            return false;
+        }
+
+        //the blocks of the time range, best bound first
+        const auto &blocks = m_blocks[sensor];
+        auto it = std::lower_bound(blocks.begin(), blocks.end(), from, [](const BlockRef &ref, int64_t t) {
+            return ref.maxLastTimestamp < t;
+        });
+        std::vector<const BlockRef *> candidates;
+        for (; it != blocks.end() && it->firstTimestamp <= to; ++it) {
+            if (it->minTemp <= it->maxTemp) {
+                candidates.push_back(&*it);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [warmest](const BlockRef *a, const BlockRef *b) {
+            return warmest ? a->maxTemp > b->maxTemp : a->minTemp < b->minTemp;
+        });
+
+        //the best sample so far, only valid once found
+        bool found = false;
+        int64_t bestTimestamp = 0;
+        double bestTemp = 0.0;
+        for (const BlockRef *ref : candidates) {
+            //sorted, so no block after this one can do better either. equal is still read,
+            //it might have reached the value earlier.
+            if (found && (warmest ? ref->maxTemp < bestTemp : ref->minTemp > bestTemp)) {
+                break;
+            }
+            BlockDecoder decoder(block(ref->index));
+            int64_t t;
+            double v;
+            while (decoder.next(t, v)) {
+                if (t < from || t > to || std::isnan(v)) {
+                    continue;
+                }
+                if (found) {
+                    bool better = warmest ? v > bestTemp : v < bestTemp;
+                    if (!better && !(v == bestTemp && t < bestTimestamp)) {
+                        continue;
+                    }
+                }
+                bestTimestamp = t;
+                bestTemp = v;
+                found = true;
+            }
+        }
+
+        if (found) {
+            timestamp = bestTimestamp;
+            temp = bestTemp;
+        }
+        return found;
+    }
+
+    TimeSeriesReader::Range::Range(const TimeSeriesReader *reader, const std::vector<BlockRef> *blocks, size_t first, int64_t from, int64_t to) : m_reader(reader), m_blocks(blocks), m_next(first), m_from(from), m_to(to), m_filtered(false), m_minTemp(0.0), m_maxTemp(0.0) {
+    }
+
+    bool TimeSeriesReader::Range::next(int64_t &timestamp, double &temp) {
+        for (;;) {
+            if (m_decoder) {
+                while (m_decoder->next(timestamp, temp)) {
+                    if (timestamp > m_to) {
+                        break;
+                    }
+                    if (timestamp >= m_from && matches(temp)) {
+                        return true;
+                    }
+                }
+                m_decoder.reset();
+            }
+
+            //blocks after the range are never decoded, nor those whose zone map rules them out
+            if (m_next >= m_blocks->size() || (*m_blocks)[m_next].firstTimestamp > m_to) {
+                return false;
+            }
+            const BlockRef &ref = (*m_blocks)[m_next++];
+            if (m_filtered && (ref.maxTemp < m_minTemp || ref.minTemp > m_maxTemp)) {
+                continue;
+            }
+            m_decoder.reset(new BlockDecoder(m_reader->block(ref.index)));
+        }
+    }
+}
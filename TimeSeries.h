@@ -0,0 +1,216 @@
+#pragma once
+#include "Types.h"
+#include "Database.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+
+//compressed append only storage for readings, an alternative to the SQLite database.
+//
+//file layout (host byte order), everything in blocks of kTimeSeriesBlockSize bytes:
+//  block 0: FileHeader
+//  block n: BlockHeader followed by the payload
+//    kBlockSensor: the payload is the serial of sensor id
+//    kBlockData:   samples of one sensor as a bit stream. per sample the timestamp as delta of
+//                  delta and the temperature XORed with the one before (like Gorilla), so a
+//                  steady 15 minute cadence costs one bit for the timestamp. temperatures in
+//                  whole hundredths (what the probes deliver) are stored as the change in
+//                  hundredths instead of the XOR.
+//                  the header keeps the lowest and highest temperature of the block (a zone map),
+//                  so threshold and extreme queries skip blocks without decoding them.
+//blocks are only appended and never move. the newest data block of every sensor is rewritten in
+//place until it is full.
+namespace db {
+    const int kTimeSeriesErrorIO = 1;
+    const int kTimeSeriesErrorFormat = 2;
+
+    //version 1 files have no zone maps: TimeSeriesStore::open() adds them, TimeSeriesReader
+    //works them out while it indexes the file
+    const uint32_t kTimeSeriesVersion = 2;
+    const size_t kTimeSeriesBlockSize = 4096;
+
+    //FileHeader::flags: the file holds aggregated points (--persist-interval), only their means
+    const uint32_t kFileAggregated = 1;
+
+    struct FileHeader {
+        char magic[8];      //"TEMPTSDB"
+        uint32_t version;
+        uint32_t blockSize;
+        uint32_t flags;     //0 in files from before it, the rest of the block is zeroed
+    };
+
+    enum BlockKind : uint16_t {
+        kBlockData = 1,
+        kBlockSensor = 2
+    };
+
+    struct BlockHeader {
+        uint32_t magic;
+        uint16_t kind;
+        uint16_t count;             //samples in the block
+        uint32_t sensor;
+        uint32_t bits;              //payload bits used
+        int64_t firstTimestamp;
+        int64_t lastTimestamp;
+        double minTemp;             //NaN is left out. +inf/-inf if there is no other sample
+        double maxTemp;
+        uint8_t reserved[16];
+    };
+    static_assert(sizeof(BlockHeader) == 64, "BlockHeader must stay 64 bytes");
+
+    const uint32_t kBlockMagic = 0x4b425354; //"TSBK"
+
+    //walks the samples of a data block in place, without copying it
+    class BlockDecoder {
+    public:
+        explicit BlockDecoder(const uint8_t *block);
+
+        //false after the last sample
+        bool next(int64_t &timestamp, double &temp);
+
+    private:
+        uint64_t readBits(int count);
+
+        const uint8_t *m_payload;
+        const BlockHeader *m_header;
+        uint32_t m_pos;
+        uint16_t m_index;
+        int64_t m_timestamp;
+        int64_t m_delta;
+        uint64_t m_value;
+        int m_leading;
+        int m_trailing;
+    };
+
+    class BlockEncoder;
+
+    //Storage for the Writer, see above. temperature means only: min/max/samples of aggregated
+    //points are not kept, the file is marked with kFileAggregated instead.
+    //a failed batch is rolled back, the file is only ever extended.
+    class TimeSeriesStore : public Storage {
+    public:
+        TimeSeriesStore();
+        ~TimeSeriesStore();
+
+        TimeSeriesStore(const TimeSeriesStore &src) = delete;
+        TimeSeriesStore &operator=(const TimeSeriesStore &src) = delete;
+
+        //creates the file if needed
+        status open(const Path path);
+        void close() override;
+
+        //writes the touched blocks and syncs the file once per batch
+        status addPoints(const Batch &points) override;
+
+    private:
+        struct OpenBlock {
+            uint64_t index;
+            std::unique_ptr<BlockEncoder> encoder;
+        };
+
+        status load();
+        status write(const Batch &points);
+        status rollback(uint64_t blockCount, const std::map<uint64_t, std::vector<uint8_t>> &saved);
+        Result<uint32_t> sensorID(const std::string &serial);
+        status writeBlock(uint64_t index, const uint8_t *block);
+        status writeFlags();
+
+        int m_fd;
+        Path m_path;
+        uint64_t m_blockCount;
+        uint32_t m_flags;
+        std::map<std::string, uint32_t> m_sensorIDs;
+        std::map<uint32_t, OpenBlock> m_open;
+    };
+
+    //read path: the file is mapped into memory and decoded in place. a sparse index with
+    //one entry per data block finds the first block of a time range with a binary search,
+    //only blocks that overlap the range are decoded.
+    //assumes every sensor's readings were appended in time order, which the Writer does.
+    class TimeSeriesReader {
+    public:
+        struct BlockRef {
+            int64_t firstTimestamp;
+            int64_t lastTimestamp;
+            int64_t maxLastTimestamp;   //of this and all earlier blocks, what the binary search runs on
+            double minTemp;
+            double maxTemp;
+            uint64_t index;
+        };
+
+        //the samples of one sensor within [from, to], in time order. a range with a temperature
+        //filter only returns samples within [minTemp, maxTemp] and skips the blocks whose zone
+        //map doesn't overlap it.
+        class Range {
+            friend TimeSeriesReader;
+
+        public:
+            bool next(int64_t &timestamp, double &temp);
+
+        private:
+            Range(const TimeSeriesReader *reader, const std::vector<BlockRef> *blocks, size_t first, int64_t from, int64_t to);
+            bool matches(double temp) const {
+                return !m_filtered || (temp >= m_minTemp && temp <= m_maxTemp);
+            }
+
+            const TimeSeriesReader *m_reader;
+            const std::vector<BlockRef> *m_blocks;
+            size_t m_next;
+            int64_t m_from;
+            int64_t m_to;
+            bool m_filtered;
+            double m_minTemp;
+            double m_maxTemp;
+            std::unique_ptr<BlockDecoder> m_decoder;
+        };
+
+        TimeSeriesReader();
+        ~TimeSeriesReader();
+
+        TimeSeriesReader(const TimeSeriesReader &src) = delete;
+        TimeSeriesReader &operator=(const TimeSeriesReader &src) = delete;
+
+        status open(const Path path);
+        void close();
+
+        //maps the file again if a writer appended blocks since open(). invalidates ranges.
+        status refresh();
+
+        //serials by sensor id
+        const std::vector<std::string> &sensors() const {
+            return m_sensors;
+        }
+
+        //whether the file holds aggregated points: ranges and extremes see their means only
+        bool aggregated() const {
+            return (m_flags & kFileAggregated) != 0;
+        }
+
+        Range range(uint32_t sensor, int64_t from, int64_t to) const;
+        Range range(uint32_t sensor, int64_t from, int64_t to, double minTemp, double maxTemp) const;
+
+        //the lowest (or highest, if warmest) temperature of one sensor within [from, to] and
+        //when it was first reached. blocks are decoded best zone map first, until no block
+        //left can beat what was found - usually one. false if there is no sample.
+        bool extreme(uint32_t sensor, int64_t from, int64_t to, bool warmest, int64_t &timestamp, double &temp) const;
+
+    private:
+        status map();
+        void unmap();
+        Range range(uint32_t sensor, int64_t from, int64_t to, bool filtered, double minTemp, double maxTemp) const;
+        const uint8_t *block(uint64_t index) const {
+            return m_data + index * kTimeSeriesBlockSize;
+        }
+
+        Path m_path;
+        int m_fd;
+        const uint8_t *m_data;
+        size_t m_size;
+        uint32_t m_flags;
+        std::vector<std::string> m_sensors;
+        std::vector<std::vector<BlockRef>> m_blocks;  //by sensor id
+    };
+}
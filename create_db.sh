@@ -1,3 +1,2 @@
 #!/bin/sh
-sqlite3 temp.db < schema.sql
-
+./tempserv --db temp.db --migrate
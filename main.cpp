@@ -1,33 +1,853 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#include <chrono>
+#include <thread>
 #include "Sensor.h"
 #include "Database.h"
+#include "Sampler.h"
+#include "Ingest.h"
+#include "Migrations.h"
+#include "TimeSeries.h"
+#include "Retention.h"
+#include "Executor.h"
+#include "Recent.h"
+
+static volatile sig_atomic_t g_running = 1;
+static volatile sig_atomic_t g_dumpRecent = 0;
+
+static void handle_signal(int) {
+    g_running = 0;
+}
+
+static void handle_dump_signal(int) {
+    g_dumpRecent = 1;
+}
+
+//wall clock time in milliseconds
+int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
 void print_error(jsz::Error err) {
-    printf("Error: %s\n", err.description.c_str());
+    printf("Error: %s\n", err.description());
 }
 
-int main(int argc, char **argv) {
-    auto temp = sensor::readTemp();
-    if (!temp) {
-        print_error(temp.error());
-        return 1;
+//--verbose: every error as it happens, with its stack. stderr keeps the readings on stdout parseable
+static void log_error(const jsz::Error &err) {
+    fprintf(stderr, "[!] jsz::Error: %i - %s - %s\n", err.code, err.context, err.description());
+    for (auto &frame : err.callstack()) {
+        fprintf(stderr, "    %s\n", frame.c_str());
+    }
+}
+
+//the sensor id is only printed when there is more than one probe. clockjob.sh parses this line.
+void print_reading(std::time_t when, double temp, const std::string &sensorID) {
+    std::tm loctm;
+    localtime_r(&when, &loctm);
+
+    if (sensorID.empty()) {
+        printf("<%02d:%02d:%02d> temp: %+.1f°\n",loctm.tm_hour, loctm.tm_min, loctm.tm_sec, (float)temp);
+    } else {
+        printf("<%02d:%02d:%02d> temp: %+.1f° %s\n",loctm.tm_hour, loctm.tm_min, loctm.tm_sec, (float)temp, sensorID.c_str());
+    }
+}
+
+//polls the source and hands the readings to the sampler. returns the number of failed readings.
+int sample(sensor::Source &source, sampler::Sampler &sampler, bool quiet) {
+    int failed = 0;
+    auto readings = source.poll();
+    for (const auto &reading : readings) {
+        if (!reading.temp) {
+            print_error(reading.temp.error());
+            failed++;
+            continue;
+        }
+
+        sampler.add(reading.sensorID, reading.timestamp, reading.temp.value());
+        if (!quiet) {
+            print_reading((std::time_t)(reading.timestamp / 1000), reading.temp.value(), readings.size() > 1 ? reading.sensorID : std::string());
+        }
+    }
+    fflush(stdout);
+
+    return failed;
+}
+
+//writes the raw samples in the buffer in the same format the plot scripts use. the file is
+//replaced as a whole, readers never see half of it.
+void dump_recent(const sampler::Sampler &sampler, const std::string &path) {
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        printf("Error: Could not open %s for writing\n", tmp.c_str());
+        return;
+    }
+
+    std::string text = sampler::formatSamples(sampler, sampler.recent(0));
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        printf("Error: Could not write %s\n", path.c_str());
+        unlink(tmp.c_str());
+    }
+}
+
+struct Options {
+    bool daemon = false;
+    bool migrateOnly = false;
+    bool exportData = false;
+    long exportSince = 0;
+    //--recent: the raw samples of the last seconds, from the running daemon
+    long recent = 0;
+    //threshold and extreme queries: above, below, coldest or warmest (--since limits them too)
+    std::string find;
+    double findTemp = 0.0;
+    //retention policy (see db::RetentionPolicy::parse()), applied by the daemon every
+    //compactInterval seconds when set. --compact applies it once, the standard policy if unset
+    std::string retention;
+    bool compact = false;
+    int compactInterval = 3600;
+    //bulk import of readings from other loggers
+    std::string importPath;
+    std::string importFormat;
+    std::string importSerial;
+    size_t importRows = 500000;
+    bool quiet = false;
+    bool verbose = false;
+    double interval = 900.0;
+    int persistInterval = 0;
+    long bufferSize = 4096;
+    //sqlite or tsdb (compressed time series file, see TimeSeries.h)
+    std::string storage = "sqlite";
+    //temp.db or temp.tsdb by default, depending on storage
+    std::string dbPath;
+    //group commit: a transaction is committed after this many rows or milliseconds
+    size_t commitRows = 1000;
+    int commitLatency = 1000;
+
+    //sensor driver: hid, sim or replay
+    std::string driver = "hid";
+    int simSensors = 1;
+    double simRate = 1.0;
+    std::string replayPath;
+    long replayBatch = 1000;
+};
+
+void print_usage(const char *name) {
+    printf("usage: %s [--daemon] [--interval <seconds>] [--persist-interval <seconds>] [--buffer <samples>]\n"
+           "          [--db <path>] [--storage sqlite|tsdb] [--quiet] [--verbose] [--commit-rows <rows>] [--commit-latency <ms>]\n"
+           "          [--driver hid|sim|replay] [--sensors <count>] [--rate <readings/s per sensor>]\n"
+           "          [--replay <temp.db>] [--batch <rows per tick>]\n"
+           "          [--retention <age>:<interval>,...] [--compact-interval <seconds>]\n"
+           "       %s --migrate [--db <path>]\n"
+           "       %s --export [--since <seconds>] [--db <path>]\n"
+           "       %s --recent <seconds> [--db <path>]\n"
+           "       %s --compact [--retention <age>:<interval>,...] [--db <path>]\n"
+           "       %s --find-above <temp> | --find-below <temp> | --coldest | --warmest [--since <seconds>] [--db <path>]\n"
+           "       %s --import <file> [--format csv|bin|sql] [--serial <sensor serial>] [--import-rows <rows per commit>] [--db <path>]\n", name, name, name, name, name, name, name);
+}
+
+std::unique_ptr<sensor::Source> make_source(const Options &opts) {
+    if (opts.driver == "sim") {
+        return std::unique_ptr<sensor::Source>(new sensor::SimulatedSource(opts.simSensors, opts.simRate));
+    }
+    if (opts.driver == "replay") {
+        return std::unique_ptr<sensor::Source>(new sensor::ReplaySource(opts.replayPath, (size_t)opts.replayBatch));
     }
+#ifdef TEMPSERV_HAVE_HIDAPI
+    if (opts.driver == "hid") {
+        return std::unique_ptr<sensor::Source>(new sensor::SensorSet());
+    }
+#endif
+    return std::unique_ptr<sensor::Source>();
+}
 
-    auto stat = db::addEntry(temp.value()/10.0);
+//creates or upgrades the database and exits
+int run_migrate(const Options &opts) {
+    db::Store store;
+    auto stat = store.open(opts.dbPath);
     if (!stat) {
         print_error(stat.error());
         return 2;
     }
+    printf("%s is at schema version %i\n", opts.dbPath.c_str(), db::latestSchemaVersion());
+    return 0;
+}
 
-    std::time_t now;
-    std::time(&now);
+//same format as all.sh
+static void print_export_line(std::time_t when, double temp) {
     std::tm loctm;
-    localtime_r(&now, &loctm);
-    
-    printf("<%02d:%02d:%02d> temp: %+.1f°\n",loctm.tm_hour, loctm.tm_min, loctm.tm_sec, (float)temp.value()/10.0f);
+    localtime_r(&when, &loctm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &loctm);
+    printf("%s|%.2f\n", buf, temp);
+}
+
+//the sensors are merged by time, like the order by timestamp of the SQLite export
+int run_export_tsdb(const Options &opts) {
+    db::TimeSeriesReader reader;
+    auto stat = reader.open(opts.dbPath);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+
+    int64_t from = opts.exportSince > 0 ? (int64_t)std::time(nullptr) - opts.exportSince : 0;
+    struct Head {
+        db::TimeSeriesReader::Range range;
+        int64_t timestamp;
+        double temp;
+        bool valid;
+    };
+    std::vector<Head> heads;
+    for (uint32_t sensor = 0; sensor < reader.sensors().size(); sensor++) {
+        Head head = {reader.range(sensor, from, INT64_MAX), 0, 0.0, false};
+        head.valid = head.range.next(head.timestamp, head.temp);
+        heads.push_back(std::move(head));
+    }
+
+    for (;;) {
+        Head *oldest = nullptr;
+        for (auto &head : heads) {
+            if (head.valid && (!oldest || head.timestamp < oldest->timestamp)) {
+                oldest = &head;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        print_export_line((std::time_t)oldest->timestamp, oldest->temp);
+        oldest->valid = oldest->range.next(oldest->timestamp, oldest->temp);
+    }
+    return 0;
+}
+
+//the query tools read through a pool of read-only connections, nothing is created or written
+status open_read_pool(sql::Pool &pool, const Options &opts, size_t readers) {
+    return pool.open(opts.dbPath, readers, sql::Options::reader(), sql::Options::reader());
+}
+
+//prints the stored readings as "date time|temp" like all.sh does, one row at a time.
+//since > 0 limits the output to the last since seconds.
+int run_export(const Options &opts) {
+    if (opts.storage == "tsdb") {
+        return run_export_tsdb(opts);
+    }
+
+    sql::Pool pool;
+    auto stat = open_read_pool(pool, opts, 1);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+
+    auto db = pool.reader();
+    auto stmt = db->prepare("select timestamp, temp from data where timestamp >= ? order by timestamp;");
+    if (!stmt) {
+        print_error(stmt.error());
+        return 2;
+    }
+    int64_t from = opts.exportSince > 0 ? (int64_t)std::time(nullptr) - opts.exportSince : 0;
+    stat = stmt.value().bind(from);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+
+    sql::Cursor rows(std::move(stmt.value()));
+    for (auto &row : rows) {
+        print_export_line((std::time_t)row.getInteger(0).value_or(0), row.getDouble(1).value_or(0.0));
+    }
+    if (!rows.error()) {
+        print_error(rows.error().error());
+        return 2;
+    }
+
+    return 0;
+}
+
+//like the export, with the serial of the probe if it has one
+//aggregated points show the bound that matched: the max for above/warmest, the min otherwise
+static void print_match(const Options &opts, const db::Match &match) {
+    double temp = opts.find == "above" || opts.find == "warmest" ? match.tempMax : match.tempMin;
+    std::tm loctm;
+    localtime_r(&match.timestamp, &loctm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &loctm);
+    if (match.serial.empty()) {
+        printf("%s|%.2f\n", buf, temp);
+    } else {
+        printf("%s|%.2f|%s\n", buf, temp, match.serial.c_str());
+    }
+}
+
+//"above" and "below" are strict, the queries take inclusive bounds
+static void find_bounds(const Options &opts, double &minTemp, double &maxTemp) {
+    minTemp = -INFINITY;
+    maxTemp = INFINITY;
+    if (opts.find == "above") {
+        minTemp = std::nextafter(opts.findTemp, INFINITY);
+    } else {
+        maxTemp = std::nextafter(opts.findTemp, -INFINITY);
+    }
+}
+
+int run_find_tsdb(const Options &opts) {
+    db::TimeSeriesReader reader;
+    auto stat = reader.open(opts.dbPath);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+    //stderr, so the matches on stdout stay parseable
+    if (reader.aggregated()) {
+        fprintf(stderr, "Warning: %s holds aggregated points (--persist-interval) without their min/max, they match on their means\n", opts.dbPath.c_str());
+    }
+
+    int64_t from = opts.exportSince > 0 ? (int64_t)std::time(nullptr) - opts.exportSince : 0;
+    std::vector<db::Match> matches;
+    for (uint32_t sensor = 0; sensor < reader.sensors().size(); sensor++) {
+        int64_t timestamp;
+        double temp;
+        if (opts.find == "coldest" || opts.find == "warmest") {
+            if (reader.extreme(sensor, from, INT64_MAX, opts.find == "warmest", timestamp, temp)) {
+                matches.push_back(db::Match{reader.sensors()[sensor], (std::time_t)timestamp, temp, temp, temp});
+            }
+            continue;
+        }
+
+        double minTemp, maxTemp;
+        find_bounds(opts, minTemp, maxTemp);
+        auto range = reader.range(sensor, from, INT64_MAX, minTemp, maxTemp);
+        while (range.next(timestamp, temp)) {
+            matches.push_back(db::Match{reader.sensors()[sensor], (std::time_t)timestamp, temp, temp, temp});
+        }
+    }
+
+    std::stable_sort(matches.begin(), matches.end(), [](const db::Match &a, const db::Match &b) {
+        return a.timestamp < b.timestamp;
+    });
+    for (const auto &match : matches) {
+        print_match(opts, match);
+    }
+    return 0;
+}
+
+//the sensors are searched side by side, each on a read lane of the executor
+int run_find(const Options &opts) {
+    if (opts.storage == "tsdb") {
+        return run_find_tsdb(opts);
+    }
+
+    sql::Pool pool;
+    auto stat = open_read_pool(pool, opts, std::max(1u, std::min(4u, std::thread::hardware_concurrency())));
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+
+    std::time_t from = opts.exportSince > 0 ? std::time(nullptr) - opts.exportSince : 0;
+    Result<std::vector<int64_t>> sensors;
+    {
+        auto db = pool.reader();
+        //the rollups come with schema version 5
+        auto version = db::schemaVersion(*db);
+        if (!version) {
+            print_error(version.error());
+            return 2;
+        }
+        if (version.value() < db::latestSchemaVersion()) {
+            printf("Error: %s is at schema version %i, run --migrate first\n", opts.dbPath.c_str(), version.value());
+            return 2;
+        }
+        sensors = db::findSensors(*db, from);
+    }
+    if (!sensors) {
+        print_error(sensors.error());
+        return 2;
+    }
+
+    bool extremes = opts.find == "coldest" || opts.find == "warmest";
+    bool warmest = opts.find == "warmest";
+    double minTemp, maxTemp;
+    find_bounds(opts, minTemp, maxTemp);
+
+    sql::Executor executor(pool);
+    std::vector<std::future<Result<std::vector<db::Match>>>> results;
+    for (int64_t sensor : sensors.value()) {
+        results.push_back(executor.read([=](sql::db &db) {
+            return extremes ? db::findExtreme(db, sensor, warmest, from) : db::findReadings(db, sensor, minTemp, maxTemp, from);
+        }));
+    }
+
+    std::vector<db::Match> matches;
+    for (auto &result : results) {
+        auto found = result.get();
+        if (!found) {
+            print_error(found.error());
+            return 2;
+        }
+        matches.insert(matches.end(), found.value().begin(), found.value().end());
+    }
+
+    std::stable_sort(matches.begin(), matches.end(), [](const db::Match &a, const db::Match &b) {
+        return a.timestamp < b.timestamp;
+    });
+    for (const auto &match : matches) {
+        print_match(opts, match);
+    }
+    return 0;
+}
+
+//asks the daemon writing to --db, the samples only live in its memory
+int run_recent(const Options &opts) {
+    auto stat = sampler::queryRecent(sampler::recentSocketPath(opts.dbPath), opts.recent, stdout);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+    return 0;
+}
+
+//--retention or the standard policy
+static Result<db::RetentionPolicy> retention_policy(const Options &opts) {
+    if (opts.retention.empty()) {
+        return db::RetentionPolicy::standard();
+    }
+    return db::RetentionPolicy::parse(opts.retention);
+}
+
+//applies the retention policy once. an older database is switched to incremental vacuum
+//first, which rewrites it - stop the daemon for that.
+int run_compact(const Options &opts) {
+    auto policy = retention_policy(opts);
+    if (!policy) {
+        print_error(policy.error());
+        return 1;
+    }
+
+    //creates or upgrades the database
+    db::Store store;
+    auto stat = store.open(opts.dbPath);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+    store.close();
+
+    db::Compactor compactor(policy.value());
+    stat = compactor.open(opts.dbPath);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+    auto vacuumed = compactor.enableIncrementalVacuum();
+    if (!vacuumed) {
+        print_error(vacuumed.error());
+        return 2;
+    }
+    if (vacuumed.value()) {
+        printf("%s switched to incremental vacuum\n", opts.dbPath.c_str());
+    }
+
+    int64_t started = now_ms();
+    auto stats = compactor.run(std::time(nullptr));
+    if (!stats) {
+        print_error(stats.error());
+        return 2;
+    }
+    printf("%llu rows removed in %llu transactions, %llu pages freed (%.1fs)\n", (unsigned long long)stats.value().rowsRemoved,
+           (unsigned long long)stats.value().transactions, (unsigned long long)stats.value().pagesFreed, (double)(now_ms() - started) / 1000.0);
+    return 0;
+}
+
+//--storage picks where the writer puts the points
+status open_writer(db::Writer &writer, const Options &opts) {
+    if (opts.storage == "tsdb") {
+        std::unique_ptr<db::TimeSeriesStore> store(new db::TimeSeriesStore());
+        auto stat = store->open(opts.dbPath);
+        if (!stat) {
+            return stat;
+        }
+        return writer.open(std::move(store));
+    }
+    return writer.open(opts.dbPath);
+}
+
+int run_import(const Options &opts) {
+    ingest::Format format = ingest::formatForPath(opts.importPath);
+    if (!opts.importFormat.empty()) {
+        auto named = ingest::formatNamed(opts.importFormat);
+        if (!named) {
+            print_error(named.error());
+            return 1;
+        }
+        format = named.value();
+    }
+
+    auto stats = ingest::importFile(opts.dbPath, opts.importPath, format, opts.importSerial, opts.importRows);
+    if (!stats) {
+        print_error(stats.error());
+        return 2;
+    }
 
+    const ingest::Stats &s = stats.value();
+    printf("imported %llu %s (%.1f MiB) in %.2fs (%.0f rows/s)\n", (unsigned long long)s.rows,
+           format == ingest::Format::SQL ? "statements" : "rows", (double)s.bytes / (1024.0 * 1024.0), s.seconds,
+           s.seconds > 0.0 ? (double)s.rows / s.seconds : 0.0);
     return 0;
 }
 
+int run_once(sensor::Source &source, const Options &opts) {
+    auto stat = source.rescan();
+    if (!stat) {
+        print_error(stat.error());
+        return 1;
+    }
+
+    db::Writer writer(opts.commitRows, opts.commitLatency);
+    stat = open_writer(writer, opts);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+
+    sampler::Sampler sampler(1, 0);
+    int failed = sample(source, sampler, opts.quiet);
+    sampler.persist(writer, now_ms(), true);
+    stat = writer.flush();
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+
+    return failed > 0 ? 1 : 0;
+}
+
+//waits for the next tick of the sampling schedule. returns false if we should stop.
+class Ticker {
+public:
+    Ticker(double interval) : m_interval(interval), m_fd(-1) {
+    }
+
+    ~Ticker() {
+#ifdef __linux__
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+#endif
+    }
+
+    status start() {
+#ifdef __linux__
+        m_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (m_fd < 0) {
+            return jsz::Error(errno, __PRETTY_FUNCTION__, "timerfd_create() failed: " + std::string(strerror(errno)));
+        }
+
+        itimerspec spec;
+        spec.it_interval.tv_sec = (time_t)m_interval;
+        spec.it_interval.tv_nsec = (long)((m_interval - (double)spec.it_interval.tv_sec) * 1e9);
+        //first tick right away
+        spec.it_value.tv_sec = 0;
+        spec.it_value.tv_nsec = 1;
+        if (timerfd_settime(m_fd, 0, &spec, nullptr) < 0) {
+            return jsz::Error(errno, __PRETTY_FUNCTION__, "timerfd_settime() failed: " + std::string(strerror(errno)));
+        }
+#endif
+        return true;
+    }
+
+    bool wait() {
+#ifdef __linux__
+        uint64_t expirations = 0;
+        for (;;) {
+            ssize_t r = read(m_fd, &expirations, sizeof(expirations));
+            if (!g_running) {
+                return false;
+            }
+            if (r == sizeof(expirations)) {
+                return true;
+            }
+            if (r < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+#else
+        //no timerfd - fall back to plain sleeping. this drifts by the time a sample takes.
+        if (m_first) {
+            m_first = false;
+            return g_running;
+        }
+        timespec ts;
+        ts.tv_sec = (time_t)m_interval;
+        ts.tv_nsec = (long)((m_interval - (double)ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR && g_running) {
+        }
+        return g_running;
+#endif
+    }
+
+private:
+    double m_interval;
+    int m_fd;
+#ifndef __linux__
+    bool m_first = true;
+#endif
+};
+
+//raw samples are kept in a ring buffer of bufferSize entries. the database only gets
+//min/max/mean per persistInterval seconds (or every sample if persistInterval is 0).
+//tempserv --recent reads them from the socket next to the database, SIGUSR1 dumps all of
+//them to recent.dat.
+int run_daemon(sensor::Source &source, const Options &opts) {
+    //no SA_RESTART: we want the blocking wait for the next tick to be interrupted
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    sa.sa_handler = handle_dump_signal;
+    sigaction(SIGUSR1, &sa, nullptr);
+
+    db::Writer writer(opts.commitRows, opts.commitLatency);
+    auto stat = open_writer(writer, opts);
+    if (!stat) {
+        print_error(stat.error());
+        return 2;
+    }
+
+    //retention runs next to the writer, on a connection of its own
+    std::unique_ptr<db::Compactor> compactor;
+    if (!opts.retention.empty()) {
+        auto policy = db::RetentionPolicy::parse(opts.retention);
+        if (!policy) {
+            print_error(policy.error());
+            return 1;
+        }
+        compactor.reset(new db::Compactor(policy.value()));
+        stat = compactor->open(opts.dbPath);
+        if (!stat) {
+            print_error(stat.error());
+            return 2;
+        }
+        compactor->start(opts.compactInterval);
+    }
+
+    Ticker ticker(opts.interval);
+    stat = ticker.start();
+    if (!stat) {
+        print_error(stat.error());
+        return 3;
+    }
+
+    //the sensors and the database stay open for the lifetime of the daemon.
+    //errors of a single reading are logged and we try again on the next tick.
+    //we only rescan (enumerate usb) when something went wrong, to pick up replugged or new probes.
+    sampler::Sampler sampler((size_t)opts.bufferSize, opts.persistInterval);
+    //without the socket --recent doesn't work, but the readings still go into the database
+    sampler::RecentServer recent(sampler);
+    stat = recent.start(sampler::recentSocketPath(opts.dbPath));
+    if (!stat) {
+        print_error(stat.error());
+    }
+    bool needsRescan = true;
+    int64_t started = now_ms();
+    while (ticker.wait()) {
+        if (g_dumpRecent) {
+            g_dumpRecent = 0;
+            dump_recent(sampler, "recent.dat");
+        }
+
+        if (needsRescan) {
+            stat = source.rescan();
+            if (!stat) {
+                print_error(stat.error());
+                continue;
+            }
+            needsRescan = false;
+        }
+
+        if (sample(source, sampler, opts.quiet) > 0) {
+            needsRescan = true;
+        }
+
+        sampler.persist(writer, now_ms());
+        stat = writer.lastError();
+        if (!stat) {
+            print_error(stat.error());
+        }
+        if (compactor) {
+            stat = compactor->lastError();
+            if (!stat) {
+                print_error(stat.error());
+            }
+        }
+
+        if (source.exhausted()) {
+            break;
+        }
+    }
+
+    if (compactor) {
+        compactor->stop();
+    }
+    sampler.persist(writer, now_ms(), true);
+    stat = writer.flush();
+    if (!stat) {
+        print_error(stat.error());
+    }
+
+    if (opts.quiet) {
+        double secs = (double)(now_ms() - started) / 1000.0;
+        printf("%lld samples in %.1fs (%.0f samples/s)\n", (long long)sampler.total(), secs, secs > 0 ? (double)sampler.total() / secs : 0.0);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasArg = i + 1 < argc;
+        if (strcmp(argv[i], "--daemon") == 0) {
+            opts.daemon = true;
+        } else if (strcmp(argv[i], "--storage") == 0 && hasArg) {
+            opts.storage = argv[++i];
+        } else if (strcmp(argv[i], "--migrate") == 0) {
+            opts.migrateOnly = true;
+        } else if (strcmp(argv[i], "--export") == 0) {
+            opts.exportData = true;
+        } else if (strcmp(argv[i], "--find-above") == 0 && hasArg) {
+            opts.find = "above";
+            opts.findTemp = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--find-below") == 0 && hasArg) {
+            opts.find = "below";
+            opts.findTemp = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--coldest") == 0) {
+            opts.find = "coldest";
+        } else if (strcmp(argv[i], "--warmest") == 0) {
+            opts.find = "warmest";
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            opts.compact = true;
+        } else if (strcmp(argv[i], "--retention") == 0 && hasArg) {
+            opts.retention = argv[++i];
+        } else if (strcmp(argv[i], "--compact-interval") == 0 && hasArg) {
+            opts.compactInterval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--import") == 0 && hasArg) {
+            opts.importPath = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && hasArg) {
+            opts.importFormat = argv[++i];
+        } else if (strcmp(argv[i], "--serial") == 0 && hasArg) {
+            opts.importSerial = argv[++i];
+        } else if (strcmp(argv[i], "--import-rows") == 0 && hasArg) {
+            opts.importRows = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--recent") == 0 && hasArg) {
+            opts.recent = atol(argv[++i]);
+            if (opts.recent <= 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--since") == 0 && hasArg) {
+            opts.exportSince = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            opts.quiet = true;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            opts.verbose = true;
+        } else if (strcmp(argv[i], "--interval") == 0 && hasArg) {
+            opts.interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--persist-interval") == 0 && hasArg) {
+            opts.persistInterval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--buffer") == 0 && hasArg) {
+            opts.bufferSize = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--db") == 0 && hasArg) {
+            opts.dbPath = argv[++i];
+        } else if (strcmp(argv[i], "--commit-rows") == 0 && hasArg) {
+            opts.commitRows = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--commit-latency") == 0 && hasArg) {
+            opts.commitLatency = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--driver") == 0 && hasArg) {
+            opts.driver = argv[++i];
+        } else if (strcmp(argv[i], "--sensors") == 0 && hasArg) {
+            opts.simSensors = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && hasArg) {
+            opts.simRate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--replay") == 0 && hasArg) {
+            opts.replayPath = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && hasArg) {
+            opts.replayBatch = atol(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opts.interval <= 0.0 || opts.persistInterval < 0 || opts.bufferSize <= 0 ||
+        opts.commitRows == 0 || opts.commitLatency < 0 || opts.importRows == 0 || opts.compactInterval <= 0 ||
+        (opts.storage != "sqlite" && opts.storage != "tsdb") ||
+        (opts.driver == "replay" && opts.replayPath.empty())) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.dbPath.empty()) {
+        opts.dbPath = opts.storage == "tsdb" ? "temp.tsdb" : "temp.db";
+    }
+    if (opts.storage == "tsdb" && (opts.migrateOnly || !opts.importPath.empty() || opts.compact || !opts.retention.empty())) {
+        printf("Error: --migrate, --import, --compact and --retention work on the SQLite database only\n");
+        return 1;
+    }
+
+    if (opts.verbose) {
+        jsz::Error::setBacktraces(true);
+        jsz::Error::setSink(log_error);
+    }
+
+    if (opts.migrateOnly) {
+        return run_migrate(opts);
+    }
+
+    if (opts.compact) {
+        return run_compact(opts);
+    }
+
+    if (opts.exportData) {
+        return run_export(opts);
+    }
+
+    if (opts.recent > 0) {
+        return run_recent(opts);
+    }
+
+    if (!opts.find.empty()) {
+        return run_find(opts);
+    }
+
+    if (!opts.importPath.empty()) {
+        return run_import(opts);
+    }
+
+    auto source = make_source(opts);
+    if (!source) {
+        printf("Error: unknown or unsupported sensor driver: %s\n", opts.driver.c_str());
+        return 1;
+    }
+
+    if (opts.daemon) {
+        return run_daemon(*source, opts);
+    }
+    return run_once(*source, opts);
+}
@@ -20,6 +20,9 @@
 # include <stdexcept>
 #include <execinfo.h>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdlib>
 
 # define REQUIRES(...) typename std::enable_if<__VA_ARGS__::value, bool>::type = false
 
@@ -79,25 +82,83 @@ namespace jsz {
     };
     
     
+    //errors are cheap by default: nothing is printed, no stack is captured and a static
+    //description (a string literal) is not copied. context is expected to be __PRETTY_FUNCTION__
+    //or another string with static storage.
+    //logging goes through Error::setSink(), stack capture is switched on with Error::setBacktraces().
     struct Error {
-        Error() noexcept : code(0), context(""), description("") {};
+        typedef void (*Sink)(const Error &err);
         
-        Error(const int &code_, const std::string &context_, const std::string &description_) noexcept : code(code_), context(context_), description(description_) {
-            printf("[!] jsz::Error: %i - %s - %s\n", code, context.c_str(), description.c_str());
-            
-            void* _callstack[128];
-            int i, frames = backtrace(_callstack, 128);
-            char** strs = backtrace_symbols(_callstack, frames);
-            for (i = 0; i < frames; ++i) {
-                callstack.push_back(std::string(strs[i]));
-            }
-            free(strs);
+        Error() noexcept : code(0), context(""), m_static("") {};
+        
+        Error(const int &code_, const char *context_, const char *description_) noexcept : code(code_), context(context_), m_static(description_) {
+            created();
         };
         
+        Error(const int &code_, const char *context_, const std::string &description_) noexcept : code(code_), context(context_), m_static(nullptr), m_text(std::make_shared<const std::string>(description_)) {
+            created();
+        };
+        
+        const char *description() const {
+            return m_text ? m_text->c_str() : m_static;
+        }
+        
+        //symbolized stack of where the error was created. empty unless backtraces are on
+        std::vector<std::string> callstack() const {
+            std::vector<std::string> ret;
+            if (!m_frames || m_frames->empty()) {
+                return ret;
+            }
+            char **strs = backtrace_symbols(m_frames->data(), (int)m_frames->size());
+            if (strs) {
+                for (size_t i = 0; i < m_frames->size(); ++i) {
+                    ret.push_back(std::string(strs[i]));
+                }
+                free(strs);
+            }
+            return ret;
+        }
+        
+        //called for every new error, nullptr (the default) logs nothing
+        static void setSink(Sink sink) {
+            sinkSlot().store(sink);
+        }
+        
+        static void setBacktraces(bool enabled) {
+            backtracesSlot().store(enabled);
+        }
+        
         int code;
-        std::string context;
-        std::string description;
-        std::vector<std::string> callstack;
+        const char *context;
+        
+    private:
+        void created() {
+            if (backtracesSlot().load(std::memory_order_relaxed)) {
+                //only the raw frames, symbols are looked up in callstack()
+                void *frames[64];
+                int n = backtrace(frames, 64);
+                m_frames = std::make_shared<const std::vector<void *>>(frames, frames + n);
+            }
+            Sink sink = sinkSlot().load(std::memory_order_relaxed);
+            if (sink) {
+                sink(*this);
+            }
+        }
+        
+        static std::atomic<Sink> &sinkSlot() {
+            static std::atomic<Sink> sink(nullptr);
+            return sink;
+        }
+        
+        static std::atomic<bool> &backtracesSlot() {
+            static std::atomic<bool> enabled(false);
+            return enabled;
+        }
+        
+        //shared so copying an error around (optional does that a lot) never copies strings
+        const char *m_static;
+        std::shared_ptr<const std::string> m_text;
+        std::shared_ptr<const std::vector<void *>> m_frames;
     };
     
     
@@ -589,7 +650,8 @@ namespace jsz {
                 return error_;
             }
             
-            Error error_or(const int &errcode, const std::string &context, const std::string &errmsg) {
+            template <class Description>
+            Error error_or(const int &errcode, const char *context, const Description &errmsg) {
                 if (has_error()) {
                     return error();
                 }
@@ -1,4 +1,5 @@
 #!/bin/sh
-./all.sh > plotdata.dat
+# daily means from the rollup table instead of every raw reading
+sqlite3 temp.db "select datetime(bucket, 'unixepoch', 'localtime') as Datum, sum(temp_sum) / sum(samples) as Temperatur from data_daily group by bucket order by bucket;" > plotdata.dat
 gnuplot -e 'set style data lines; set datafile separator "|"; set terminal postscript color solid; set output "all.ps"; set xdata time; set timefmt x "%Y-%m-%d %H:%M:%S"; set grid; plot "./plotdata.dat" u 1:2 with lines; quit;'
 rm plotdata.dat
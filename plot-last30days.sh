@@ -1,4 +1,5 @@
 #!/bin/sh
-./last-30-days.sh > plotdata.dat
+# hourly means from the rollup table instead of every raw reading
+sqlite3 temp.db "select datetime(bucket, 'unixepoch', 'localtime') as Datum, sum(temp_sum) / sum(samples) as Temperatur from data_hourly where bucket >= (strftime('%s', datetime('now')) - 86400 * 30) group by bucket order by bucket;" > plotdata.dat
 gnuplot -e 'set style data lines; set datafile separator "|"; set terminal postscript color solid; set output "last30d.ps"; set xdata time; set timefmt x "%Y-%m-%d %H:%M:%S"; set grid; plot "./plotdata.dat" u 1:2 with lines; quit;'
 rm plotdata.dat
@@ -1,5 +1,2 @@
 #!/bin/sh
-while true; do
-sudo ./tempserv
-sleep 900 
-done
+sudo ./tempserv --daemon --interval 900
@@ -1,3 +1,13 @@
+-- the schema tempserv creates (schema version 5). tempserv sets up and upgrades databases itself,
+-- see Migrations.cpp - this file is for reference and for creating a database by hand.
+-- deleted pages (see --compact) go back to the file system with PRAGMA incremental_vacuum. this only
+-- takes effect before the first table is created.
+PRAGMA auto_vacuum = INCREMENTAL;
 BEGIN TRANSACTION;
-CREATE TABLE data (id integer primary key, timestamp integer NOT NULL, temp real NOT NULL);
+CREATE TABLE sensors (id integer primary key, serial text NOT NULL UNIQUE);
+CREATE TABLE data (id integer primary key, timestamp integer NOT NULL, temp real NOT NULL, sensor_id integer NOT NULL DEFAULT 0, temp_min real, temp_max real, samples integer NOT NULL DEFAULT 1);
+CREATE INDEX data_timestamp_temp on data (timestamp, temp);
+CREATE TABLE data_hourly (sensor_id integer NOT NULL, bucket integer NOT NULL, temp_min real NOT NULL, temp_max real NOT NULL, temp_sum real NOT NULL, samples integer NOT NULL, primary key (sensor_id, bucket));
+CREATE TABLE data_daily (sensor_id integer NOT NULL, bucket integer NOT NULL, temp_min real NOT NULL, temp_max real NOT NULL, temp_sum real NOT NULL, samples integer NOT NULL, primary key (sensor_id, bucket));
+PRAGMA user_version = 5;
 COMMIT;
@@ -0,0 +1,37 @@
+#!/bin/sh
+# compacts a copy of temp.db tier by tier and checks that --coldest, --warmest, --find-above and
+# --find-below still find the same temperatures and hours as on the raw readings.
+# usage: test-find-compacted.sh <tempserv> <temp.db>
+
+TEMPSERV=$1
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+export TZ=UTC
+
+cp "$2" "$DIR/temp.db" || exit 1
+"$TEMPSERV" --migrate --db "$DIR/temp.db" > /dev/null || exit 1
+
+# the temperature of the extremes, the hours of the threshold queries
+find() {
+	"$TEMPSERV" --coldest --db "$1" | cut -d'|' -f2
+	"$TEMPSERV" --warmest --db "$1" | cut -d'|' -f2
+	"$TEMPSERV" --find-above 30 --db "$1" | cut -c1-13 | uniq
+	"$TEMPSERV" --find-below 4 --db "$1" | cut -c1-13 | uniq
+}
+
+find "$DIR/temp.db" > "$DIR/raw.txt" || exit 1
+if [ ! -s "$DIR/raw.txt" ]; then
+	echo "no readings found in $2"
+	exit 1
+fi
+
+# 5 minute points first, then those are merged again into hourly points
+for RETENTION in 1d:5m 1d:5m,2d:1h; do
+	"$TEMPSERV" --compact --retention $RETENTION --db "$DIR/temp.db" > /dev/null || exit 1
+	find "$DIR/temp.db" > "$DIR/compacted.txt" || exit 1
+
+	if ! diff -u "$DIR/raw.txt" "$DIR/compacted.txt"; then
+		echo "compaction with --retention $RETENTION changed the results of the --find-* queries"
+		exit 1
+	fi
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+# imports the same readings as a CSV with unix timestamps and as a CSV with local dates (the
+# --export format) and checks that both end up the same. the readings cross the switch to
+# daylight saving time.
+# usage: test-import-csv.sh <tempserv>
+
+TEMPSERV=$1
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+export TZ=Europe/Berlin
+
+# 2017-03-26 00:00 UTC, every 97 seconds for 8 hours
+awk 'BEGIN { for (i = 0; i < 300; i++) printf "%d,%.2f\n", 1490486400 + i * 97, 15 + (i % 40) / 8 }' > "$DIR/epoch.csv"
+
+"$TEMPSERV" --import "$DIR/epoch.csv" --db "$DIR/epoch.db" > /dev/null || exit 1
+"$TEMPSERV" --export --db "$DIR/epoch.db" > "$DIR/dates.csv" || exit 1
+if [ "$(wc -l < "$DIR/dates.csv")" -ne 300 ]; then
+	echo "expected 300 readings from epoch.csv"
+	exit 1
+fi
+
+"$TEMPSERV" --import "$DIR/dates.csv" --format csv --db "$DIR/dates.db" > /dev/null || exit 1
+"$TEMPSERV" --export --db "$DIR/dates.db" > "$DIR/export.csv" || exit 1
+
+if ! diff -u "$DIR/dates.csv" "$DIR/export.csv"; then
+	echo "CSV lines with dates were imported at other times than the same unix timestamps"
+	exit 1
+fi